@@ -223,9 +223,17 @@ RcppExport SEXP C_sprdist(SEXP, SEXP, SEXP);
 RcppExport SEXP FS4(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 RcppExport SEXP FS5(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 RcppExport SEXP LogLik2(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
-RcppExport SEXP PML0(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
-RcppExport SEXP PML4(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+RcppExport SEXP PML0(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+RcppExport SEXP PML4(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+RcppExport SEXP PMLMix(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+RcppExport SEXP PMLMulti(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+RcppExport SEXP PMLPart(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+RcppExport SEXP PMLStream(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 RcppExport SEXP PWI(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+RcppExport SEXP SHtest(SEXP, SEXP, SEXP, SEXP);
+RcppExport SEXP ancMarg(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+RcppExport SEXP ancJoint(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+RcppExport SEXP ancSample(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 RcppExport SEXP dist2spectra(SEXP, SEXP, SEXP);
 RcppExport SEXP getDAD(SEXP, SEXP, SEXP, SEXP, SEXP);
 RcppExport SEXP getPM(SEXP, SEXP, SEXP, SEXP);
@@ -234,10 +242,21 @@ RcppExport SEXP getdPM(SEXP, SEXP, SEXP, SEXP);
 RcppExport SEXP getdPM2(SEXP, SEXP, SEXP, SEXP);
 RcppExport SEXP grpDupAtomMat(SEXP, SEXP, SEXP);
 RcppExport SEXP invSites(SEXP, SEXP, SEXP, SEXP, SEXP);
+RcppExport SEXP ll_ctx_free(SEXP);
+RcppExport SEXP ll_ctx_new(SEXP, SEXP, SEXP, SEXP, SEXP);
+RcppExport SEXP ll_ctx_option(SEXP, SEXP, SEXP);
 RcppExport SEXP ll_free2();
 RcppExport SEXP ll_init2(SEXP, SEXP, SEXP, SEXP);
-RcppExport SEXP optE(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
-RcppExport SEXP optQrtt(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+RcppExport SEXP optE(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+RcppExport SEXP optECkpt(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+RcppExport SEXP optMixW(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+RcppExport SEXP optNNI(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+RcppExport SEXP optQrtt(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+RcppExport SEXP optSPR(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+RcppExport SEXP pmlGrad(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+RcppExport SEXP rell_free(SEXP);
+RcppExport SEXP rell_new(SEXP, SEXP, SEXP);
+RcppExport SEXP rell_update(SEXP, SEXP);
 RcppExport SEXP rowMax(SEXP, SEXP, SEXP);
 RcppExport SEXP sankoffMPR(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 RcppExport SEXP sankoff_c(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
@@ -269,9 +288,17 @@ static const R_CallMethodDef CallEntries[] = {
     {"FS4",                        (DL_FUNC) &FS4,                        15},
     {"FS5",                        (DL_FUNC) &FS5,                        11},
     {"LogLik2",                    (DL_FUNC) &LogLik2,                    10},
-    {"PML0",                       (DL_FUNC) &PML0,                       14},
-    {"PML4",                       (DL_FUNC) &PML4,                       15},
+    {"PML0",                       (DL_FUNC) &PML0,                       15},
+    {"PML4",                       (DL_FUNC) &PML4,                       16},
+    {"PMLMix",                     (DL_FUNC) &PMLMix,                     15},
+    {"PMLMulti",                   (DL_FUNC) &PMLMulti,                    6},
+    {"PMLPart",                    (DL_FUNC) &PMLPart,                     7},
+    {"PMLStream",                  (DL_FUNC) &PMLStream,                   7},
     {"PWI",                        (DL_FUNC) &PWI,                         6},
+    {"SHtest",                     (DL_FUNC) &SHtest,                      4},
+    {"ancMarg",                    (DL_FUNC) &ancMarg,                    15},
+    {"ancJoint",                   (DL_FUNC) &ancJoint,                   14},
+    {"ancSample",                  (DL_FUNC) &ancSample,                  13},
     {"dist2spectra",               (DL_FUNC) &dist2spectra,                3},
     {"getDAD",                     (DL_FUNC) &getDAD,                      5},
     {"getPM",                      (DL_FUNC) &getPM,                       4},
@@ -280,10 +307,21 @@ static const R_CallMethodDef CallEntries[] = {
     {"getdPM2",                    (DL_FUNC) &getdPM2,                     4},
     {"grpDupAtomMat",              (DL_FUNC) &grpDupAtomMat,               3},
     {"invSites",                   (DL_FUNC) &invSites,                    5},
+    {"ll_ctx_free",                (DL_FUNC) &ll_ctx_free,                 1},
+    {"ll_ctx_new",                 (DL_FUNC) &ll_ctx_new,                  5},
+    {"ll_ctx_option",              (DL_FUNC) &ll_ctx_option,               3},
     {"ll_free2",                   (DL_FUNC) &ll_free2,                    0},
     {"ll_init2",                   (DL_FUNC) &ll_init2,                    4},
-    {"optE",                       (DL_FUNC) &optE,                       18},
-    {"optQrtt",                    (DL_FUNC) &optQrtt,                    17},
+    {"optE",                       (DL_FUNC) &optE,                       22},
+    {"optECkpt",                   (DL_FUNC) &optECkpt,                   21},
+    {"optMixW",                    (DL_FUNC) &optMixW,                     6},
+    {"optNNI",                     (DL_FUNC) &optNNI,                     22},
+    {"optQrtt",                    (DL_FUNC) &optQrtt,                    19},
+    {"optSPR",                     (DL_FUNC) &optSPR,                     21},
+    {"pmlGrad",                    (DL_FUNC) &pmlGrad,                    17},
+    {"rell_free",                  (DL_FUNC) &rell_free,                   1},
+    {"rell_new",                   (DL_FUNC) &rell_new,                    3},
+    {"rell_update",                (DL_FUNC) &rell_update,                 2},
     {"rowMax",                     (DL_FUNC) &rowMax,                      3},
     {"sankoffMPR",                 (DL_FUNC) &sankoffMPR,                  7},
     {"sankoff_c",                  (DL_FUNC) &sankoff_c,                  10},
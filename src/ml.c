@@ -13,9 +13,18 @@
 #include <R.h>
 #include <Rinternals.h>
 #include <R_ext/BLAS.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef _OPENMP
+# include <omp.h>
+#endif
 #ifndef FCONE
 # define FCONE
 #endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# include <immintrin.h>
+# define PHANGORN_X86 1
+#endif
 
 
 #define LINDEX(i, k) (i - ntips - 1L) * (nr * nc) + k * ntips * (nr * nc)
@@ -32,27 +41,282 @@ const double ScaleMAX = 4294967296.0;
 const double LOG_SCALE_EPS = -22.18070977791824915926;
 
 
-static double *LL;  //, *WEIGHTS;
-static int *SCM; //, *XXX;
+/*
+ * A likelihood context owns the buffers of one model fit:
+ * LL  likelihood vectors (CLVs) for the internal nodes
+ * SCM scaling coefficients for LL
+ * P   cache of transition matrices, one slot per (edge, rate category)
+ * T   lookup tables contrast %*% P for edges leading to tips
+ * Each entry point receives a context as external pointer (ll_ctx_new), so
+ * several fits can live side by side. ll_init2 / ll_free2 manage a default
+ * context which is used when R_NilValue is supplied instead.
+ *
+ * LL is stored in one of two layouts:
+ * LL_NODE_MAJOR  [rate][node][state][site], see LINDEX, one scaling count
+ *                per rate, node and site in SCM
+ * LL_SITE_MAJOR  [node][site][rate][state], the k * nc values of a site are
+ *                contiguous and start on a 64 byte boundary (sstride doubles
+ *                per site), one scaling count per node and site for all
+ *                rate categories. Only used by PML0 and PML4.
+ */
+#define LL_NODE_MAJOR 0
+#define LL_SITE_MAJOR 1
+
+
+// state of the incremental evaluation (see ll_ctx_changed): node, edge and
+// edge lengths of the last evaluation, first edge and number of children
+// per node, vok marks nodes whose vectors have not been changed since
+typedef struct ll_inc {
+    int vk, *vnode, *vedge, *vstart, *vcnt, *vok;
+    double *vel, *vg;
+    uint64_t vhash;
+} ll_inc;
+
+
+typedef struct ll_ctx {
+    int nr, nc, k, ntips, layout, sstride;
+    double *LL, *LLraw;
+    int *SCM;
+    // transition matrix cache, slots are indexed by child node and rate
+    // and are valid as long as edge length, rate and eigen system match
+    double *P, *Pel, *Pg, *Peig, *Ptmp;
+    // tip lookup tables share the slots of the transition matrix cache,
+    // TT is scratch space for the state pair table of a cherry
+    int nco, *Tvalid;
+    double *contrast, *T, *TT;
+    // threads used by PML4 to split the site patterns into blocks
+    int nthreads;
+    // site repeats (see siteRepeats): classes rcls and representatives rrep
+    // per node and site, number of classes ru per block and node. They are
+    // valid for the tree in redge (node and edge), block size rblk and tip
+    // data with checksum rhash.
+    int repeats, rvalid, rn, rblk, *rcls, *rrep, *ru, *redge;
+    uint64_t rhash;
+    // undetermined sites (see siteMasks): states with a row of ones in
+    // contrast (und, nund of them), active sites are flagged per node and
+    // site in mflag and counted per block and node in mcnt. They are valid
+    // together with the site repeats.
+    int gaps, *und, nund, *mcnt;
+    char *mflag;
+    // incremental evaluation of the vectors in LL
+    int incremental;
+    ll_inc inc;
+    // single precision evaluation in PML4 (see pmlFloat): vectors LLf and
+    // scaling counts SCf with their own incremental state incf, fall back to
+    // double if there are more than fscale scaling events per site and rate
+    // category, nfloat counts the evaluations done in single precision
+    int precision, fscale, *SCf, nfloat;
+    float *LLf;
+    ll_inc incf;
+} ll_ctx;
+
+
+static ll_ctx *LLCTX0 = NULL;
+
+
+static ll_ctx *ll_ctx_alloc(int nr, int ntips, int nc, int k, int layout){
+    size_t nLL, nSC;
+    ll_ctx *ctx = (ll_ctx *) calloc(1, sizeof(ll_ctx));
+    if(ctx == NULL) error("could not allocate likelihood context");
+    ctx->nr = nr;
+    ctx->nc = nc;
+    ctx->k = k;
+    ctx->ntips = ntips;
+    ctx->nthreads = 1L;
+    ctx->repeats = 1L;
+    ctx->gaps = 1L;
+    ctx->incremental = 1L;
+    ctx->fscale = 1024L;
+    ctx->layout = layout;
+    ctx->sstride = ((k * nc + 7L) / 8L) * 8L;
+    if(layout == LL_SITE_MAJOR){
+        nLL = (size_t) nr * ctx->sstride * ntips;
+        nSC = (size_t) nr * ntips;
+    }
+    else{
+        nLL = (size_t) nr * nc * k * ntips;
+        nSC = (size_t) nr * k * ntips;
+    }
+    // 64 extra bytes to align LL to a cache line
+    ctx->LLraw = (double *) calloc(nLL + 8L, sizeof(double));
+    ctx->SCM = (int *) calloc(nSC, sizeof(int));
+    if(ctx->LLraw == NULL || ctx->SCM == NULL){
+        free(ctx->LLraw);
+        free(ctx->SCM);
+        free(ctx);
+        error("could not allocate likelihood context");
+    }
+    ctx->LL = (double *) (((uintptr_t) ctx->LLraw + 63L) & ~((uintptr_t) 63L));
+    return ctx;
+}
+
+
+static void ll_inc_release(ll_inc *v){
+    free(v->vnode);
+    free(v->vedge);
+    free(v->vstart);
+    free(v->vcnt);
+    free(v->vok);
+    free(v->vel);
+    free(v->vg);
+}
+
+
+static void ll_ctx_release(ll_ctx *ctx){
+    if(ctx == NULL) return;
+    free(ctx->LLraw);
+    free(ctx->SCM);
+    free(ctx->P);
+    free(ctx->Pel);
+    free(ctx->Pg);
+    free(ctx->Peig);
+    free(ctx->Ptmp);
+    free(ctx->contrast);
+    free(ctx->T);
+    free(ctx->TT);
+    free(ctx->Tvalid);
+    free(ctx->rcls);
+    free(ctx->rrep);
+    free(ctx->ru);
+    free(ctx->redge);
+    free(ctx->und);
+    free(ctx->mcnt);
+    free(ctx->mflag);
+    ll_inc_release(&ctx->inc);
+    ll_inc_release(&ctx->incf);
+    free(ctx->LLf);
+    free(ctx->SCf);
+    free(ctx);
+}
+
+
+static void ll_ctx_finalize(SEXP CTX){
+    ll_ctx_release((ll_ctx *) R_ExternalPtrAddr(CTX));
+    R_ClearExternalPtr(CTX);
+}
+
+
+// context for an entry point, R_NilValue selects the default context
+static ll_ctx *getLLCtx(SEXP CTX, int nr, int ntips, int nc, int k){
+    ll_ctx *ctx = LLCTX0;
+    if(TYPEOF(CTX) == EXTPTRSXP){
+        ctx = (ll_ctx *) R_ExternalPtrAddr(CTX);
+        if(ctx == NULL) error("likelihood context has been freed");
+    }
+    if(ctx == NULL) error("likelihood context not initialized, call pml.init first");
+    if(ctx->nr != nr || ctx->nc != nc || ctx->ntips != ntips || ctx->k < k)
+        error("likelihood context does not match the data");
+    return ctx;
+}
+
+
+static void ll_inc_dirty(ll_inc *v, int node, int ntips){
+    if(v->vok == NULL) return;
+    if(node < 0) v->vk = 0L;
+    else if(node > ntips) v->vok[node - ntips - 1L] = 0L;
+}
+
+
+// likelihood vectors of node (all nodes if node < 0) were changed outside
+// of PML4 and have to be recomputed in the next evaluation, the single
+// precision vectors are recomputed too
+static void ll_ctx_dirty(ll_ctx *ctx, int node){
+    ll_inc_dirty(&ctx->inc, node, ctx->ntips);
+    ll_inc_dirty(&ctx->incf, node, ctx->ntips);
+}
+
+
+// for computations on the likelihood vectors of single nodes
+static ll_ctx *getLLCtxNode(SEXP CTX, int nr, int ntips, int nc, int k){
+    ll_ctx *ctx = getLLCtx(CTX, nr, ntips, nc, k);
+    if(ctx->layout != LL_NODE_MAJOR)
+        error("likelihood context with site major layout only supports pml.fit");
+    return ctx;
+}
 
 
 SEXP ll_free2(void){
-    free(LL);
-    free(SCM);
+    ll_ctx_release(LLCTX0);
+    LLCTX0 = NULL;
     return R_NilValue;
 }
 
 
 SEXP ll_init2(SEXP nr, SEXP nTips, SEXP nc, SEXP k)
 {
-    int nrx = INTEGER(nr)[0], nTipsx = INTEGER(nTips)[0], ncx = INTEGER(nc)[0], kx = INTEGER(k)[0];
-    int i;
-    LL = (double *) calloc(nrx * ncx * kx * nTipsx, sizeof(double));
-    SCM = (int *) calloc(nrx * kx * nTipsx, sizeof(int));  // * 2L
-    for(i =0; i < (nrx * kx * nTipsx); i++) SCM[i] = 0L;
+    ll_ctx_release(LLCTX0);
+    LLCTX0 = NULL;
+    LLCTX0 = ll_ctx_alloc(INTEGER(nr)[0], INTEGER(nTips)[0], INTEGER(nc)[0], INTEGER(k)[0], LL_NODE_MAJOR);
+    return R_NilValue;
+}
+
+
+SEXP ll_ctx_new(SEXP nr, SEXP nTips, SEXP nc, SEXP k, SEXP layout)
+{
+    SEXP CTX;
+    ll_ctx *ctx = ll_ctx_alloc(INTEGER(nr)[0], INTEGER(nTips)[0], INTEGER(nc)[0], INTEGER(k)[0], INTEGER(layout)[0]);
+    PROTECT(CTX = R_MakeExternalPtr(ctx, R_NilValue, R_NilValue));
+    R_RegisterCFinalizerEx(CTX, ll_ctx_finalize, TRUE);
+    UNPROTECT(1);
+    return CTX;
+}
+
+
+SEXP ll_ctx_free(SEXP CTX)
+{
+    if(TYPEOF(CTX) == EXTPTRSXP) ll_ctx_finalize(CTX);
     return R_NilValue;
 }
 
+
+// set an option of a context, returns the value used
+// "threads"  threads for PML4, always 1 without OpenMP support
+// "repeats"  use site repeats in PML4 (0 or 1)
+// "gaps"  skip sites undetermined below a node in PML4 (0 or 1)
+// "incremental"  only recompute changed likelihood vectors in PML4 (0 or 1)
+// "precision"  1 evaluates PML4 in single precision, 0 in double
+// "fscale"  scaling events per site and rate above which single precision
+//           falls back to double
+// "nfloat"  evaluations done in single precision so far, VALUE resets it
+SEXP ll_ctx_option(SEXP CTX, SEXP NAME, SEXP VALUE)
+{
+    ll_ctx *ctx = LLCTX0;
+    const char *name = CHAR(STRING_ELT(NAME, 0));
+    int value = INTEGER(VALUE)[0];
+    if(TYPEOF(CTX) == EXTPTRSXP) ctx = (ll_ctx *) R_ExternalPtrAddr(CTX);
+    if(ctx == NULL) error("likelihood context not initialized");
+    if(strcmp(name, "threads") == 0){
+#ifdef _OPENMP
+        ctx->nthreads = value > 1L ? value : 1L;
+#else
+        ctx->nthreads = 1L;
+#endif
+        value = ctx->nthreads;
+    }
+    else if(strcmp(name, "repeats") == 0){
+        ctx->repeats = value = (value != 0L);
+        ctx->rvalid = 0L;
+    }
+    else if(strcmp(name, "gaps") == 0){
+        ctx->gaps = value = (value != 0L);
+        ctx->rvalid = 0L;
+    }
+    else if(strcmp(name, "incremental") == 0){
+        ctx->incremental = value = (value != 0L);
+        ll_ctx_dirty(ctx, -1L);
+    }
+    // the single precision vectors are kept for the next switch to float
+    else if(strcmp(name, "precision") == 0) ctx->precision = value = (value != 0L);
+    else if(strcmp(name, "fscale") == 0) ctx->fscale = value = value > 0L ? value : 0L;
+    else if(strcmp(name, "nfloat") == 0){
+        int old = ctx->nfloat;
+        ctx->nfloat = value;
+        value = old;
+    }
+    else error("unknown option of likelihood context: %s", name);
+    return ScalarInteger(value);
+}
+
 /*
 LL likelihood for internal edges
 SCM scaling coefficients
@@ -81,17 +345,15 @@ SEXP invSites(SEXP dlist, SEXP nr, SEXP nc, SEXP contrast, SEXP nco){
 }
 
 
-void scaleMatrix(double *X, int *nr, int *nc, int *result){
+// rescale rows of the n x nc block X with leading dimension ld
+static void scaleBlock(double *X, int n, int ld, int nc, int *result){
     int i, j;
     double tmp;
-    for(i = 0; i < *nr; i++) {
+    for(i = 0; i < n; i++) {
         tmp = 0.0;
-        for(j = 0; j < *nc; j++){
-//          if(X[i + j* *nr] < 0.0) X[i + j* *nr] = 0.0;
-          tmp += X[i + j* *nr];
-        }
+        for(j = 0; j < nc; j++) tmp += X[i + j*ld];
         while(tmp < ScaleEPS && tmp > 0.0){
-           for(j = 0; j < *nc; j++) X[i + j* *nr] *=ScaleMAX;
+           for(j = 0; j < nc; j++) X[i + j*ld] *=ScaleMAX;
            result[i] +=1L;
            tmp *= ScaleMAX;
        }
@@ -99,6 +361,246 @@ void scaleMatrix(double *X, int *nr, int *nc, int *result){
 }
 
 
+void scaleMatrix(double *X, int *nr, int *nc, int *result){
+    scaleBlock(X, *nr, *nr, *nc, result);
+}
+
+
+/*
+ * Kernels for 4 states (nucleotides). For nc=4 the BLAS call overhead
+ * dominates, so the product X %*% P is computed directly and combined with
+ * the following elementwise operation in one pass over the site patterns:
+ * KERNEL4_SET   res = X %*% P
+ * KERNEL4_MULT  res *= X %*% P, if sc != NULL rows of res get rescaled
+ *               like in scaleMatrix and sc is incremented
+ * KERNEL4_DIV   res /= X %*% P
+ * X and res are n x 4 matrices (column major) with leading dimension ld,
+ * P is 4 x 4.
+ * AVX2/FMA or SSE2 versions are selected at runtime.
+ */
+#define KERNEL4_SET 0
+#define KERNEL4_MULT 1
+#define KERNEL4_DIV 2
+
+typedef void (*kernel4_fun)(const double *, const double *, int, int, double *, int *, int);
+
+
+static void kernel4_scaleRow(double *res, int ld, int i, int *sc){
+    double tmp = res[i] + res[i + ld] + res[i + 2*ld] + res[i + 3*ld];
+    while(tmp < ScaleEPS && tmp > 0.0){
+        res[i] *= ScaleMAX;
+        res[i + ld] *= ScaleMAX;
+        res[i + 2*ld] *= ScaleMAX;
+        res[i + 3*ld] *= ScaleMAX;
+        sc[i] += 1L;
+        tmp *= ScaleMAX;
+    }
+}
+
+
+static void kernel4_tail(const double *X, const double *P, int start, int n,
+    int ld, double *res, int *sc, int op){
+    int i, j;
+    double x0, x1, x2, x3, y;
+    for(i = start; i < n; i++){
+        x0 = X[i];
+        x1 = X[i + ld];
+        x2 = X[i + 2*ld];
+        x3 = X[i + 3*ld];
+        for(j = 0; j < 4; j++){
+            y = x0 * P[4*j] + x1 * P[1 + 4*j] + x2 * P[2 + 4*j] + x3 * P[3 + 4*j];
+            if(op == KERNEL4_SET) res[i + j*ld] = y;
+            else if(op == KERNEL4_MULT) res[i + j*ld] *= y;
+            else res[i + j*ld] /= y;
+        }
+        if(sc != NULL) kernel4_scaleRow(res, ld, i, sc);
+    }
+}
+
+
+static void kernel4_scalar(const double *X, const double *P, int n, int ld,
+    double *res, int *sc, int op){
+    kernel4_tail(X, P, 0, n, ld, res, sc, op);
+}
+
+
+#ifdef PHANGORN_X86
+__attribute__((target("sse2")))
+static void kernel4_sse2(const double *X, const double *P, int n, int ld,
+    double *res, int *sc, int op){
+    int i, j, nr2 = n - (n % 2);
+    __m128d x0, x1, x2, x3, y, sum, eps = _mm_set1_pd(ScaleEPS);
+    for(i = 0; i < nr2; i += 2){
+        x0 = _mm_loadu_pd(&X[i]);
+        x1 = _mm_loadu_pd(&X[i + ld]);
+        x2 = _mm_loadu_pd(&X[i + 2*ld]);
+        x3 = _mm_loadu_pd(&X[i + 3*ld]);
+        sum = _mm_setzero_pd();
+        for(j = 0; j < 4; j++){
+            y = _mm_add_pd(
+                _mm_add_pd(_mm_mul_pd(x0, _mm_set1_pd(P[4*j])),
+                           _mm_mul_pd(x1, _mm_set1_pd(P[1 + 4*j]))),
+                _mm_add_pd(_mm_mul_pd(x2, _mm_set1_pd(P[2 + 4*j])),
+                           _mm_mul_pd(x3, _mm_set1_pd(P[3 + 4*j]))));
+            if(op == KERNEL4_MULT) y = _mm_mul_pd(_mm_loadu_pd(&res[i + j*ld]), y);
+            else if(op == KERNEL4_DIV) y = _mm_div_pd(_mm_loadu_pd(&res[i + j*ld]), y);
+            _mm_storeu_pd(&res[i + j*ld], y);
+            sum = _mm_add_pd(sum, y);
+        }
+        if(sc != NULL && _mm_movemask_pd(_mm_cmplt_pd(sum, eps))){
+            kernel4_scaleRow(res, ld, i, sc);
+            kernel4_scaleRow(res, ld, i + 1, sc);
+        }
+    }
+    kernel4_tail(X, P, nr2, n, ld, res, sc, op);
+}
+
+
+__attribute__((target("avx2,fma")))
+static void kernel4_avx2(const double *X, const double *P, int n, int ld,
+    double *res, int *sc, int op){
+    int i, j, h, nr4 = n - (n % 4);
+    __m256d x0, x1, x2, x3, y, sum, eps = _mm256_set1_pd(ScaleEPS);
+    for(i = 0; i < nr4; i += 4){
+        x0 = _mm256_loadu_pd(&X[i]);
+        x1 = _mm256_loadu_pd(&X[i + ld]);
+        x2 = _mm256_loadu_pd(&X[i + 2*ld]);
+        x3 = _mm256_loadu_pd(&X[i + 3*ld]);
+        sum = _mm256_setzero_pd();
+        for(j = 0; j < 4; j++){
+            y = _mm256_mul_pd(x0, _mm256_broadcast_sd(&P[4*j]));
+            y = _mm256_fmadd_pd(x1, _mm256_broadcast_sd(&P[1 + 4*j]), y);
+            y = _mm256_fmadd_pd(x2, _mm256_broadcast_sd(&P[2 + 4*j]), y);
+            y = _mm256_fmadd_pd(x3, _mm256_broadcast_sd(&P[3 + 4*j]), y);
+            if(op == KERNEL4_MULT) y = _mm256_mul_pd(_mm256_loadu_pd(&res[i + j*ld]), y);
+            else if(op == KERNEL4_DIV) y = _mm256_div_pd(_mm256_loadu_pd(&res[i + j*ld]), y);
+            _mm256_storeu_pd(&res[i + j*ld], y);
+            sum = _mm256_add_pd(sum, y);
+        }
+        if(sc != NULL && _mm256_movemask_pd(_mm256_cmp_pd(sum, eps, _CMP_LT_OQ))){
+            for(h = 0; h < 4; h++) kernel4_scaleRow(res, ld, i + h, sc);
+        }
+    }
+    kernel4_tail(X, P, nr4, n, ld, res, sc, op);
+}
+#endif
+
+
+/*
+ * Kernels for the site major layout: res = X %*% P for all rate categories
+ * of the sites 0, ..., len - 1. X and res hold per site k vectors of length
+ * nc (stride doubles apart), PT are the rows of P for the first rate
+ * category, the rows for category h start at PT + h * pstride.
+ * op is KERNEL4_SET or KERNEL4_MULT, y is scratch space.
+ */
+typedef void (*kernelSite_fun)(const double *, const double *, size_t, int, int,
+    int, int, double *, double *, int);
+
+
+static void kernelSite_scalar(const double *X, const double *PT, size_t pstride,
+    int len, int stride, int k, int nc, double *res, double *y, int op){
+    int s, h, i, j;
+    const double *x, *p;
+    double *r;
+    for(s = 0; s < len; s++){
+        for(h = 0; h < k; h++){
+            x = &X[(size_t) s * stride + h * nc];
+            r = &res[(size_t) s * stride + h * nc];
+            p = &PT[h * pstride];
+            for(j = 0; j < nc; j++) y[j] = x[0] * p[j];
+            for(i = 1; i < nc; i++){
+                for(j = 0; j < nc; j++) y[j] += x[i] * p[i * nc + j];
+            }
+            if(op == KERNEL4_SET) for(j = 0; j < nc; j++) r[j] = y[j];
+            else for(j = 0; j < nc; j++) r[j] *= y[j];
+        }
+    }
+}
+
+
+// larger nc: the states of one rate category form a nc x len matrix with
+// leading dimension stride, so BLAS can be used, y needs nc * len doubles
+static void kernelSite_blas(const double *X, const double *PT, size_t pstride,
+    int len, int stride, int k, int nc, double *res, double *y, int op){
+    int s, h, j;
+    for(h = 0; h < k; h++){
+        if(op == KERNEL4_SET){
+            F77_CALL(dgemm)("N", "N", &nc, &len, &nc, &one, &PT[h * pstride], &nc, &X[h * nc], &stride, &zero, &res[h * nc], &stride FCONE FCONE);
+        }
+        else{
+            F77_CALL(dgemm)("N", "N", &nc, &len, &nc, &one, &PT[h * pstride], &nc, &X[h * nc], &stride, &zero, y, &nc FCONE FCONE);
+            for(s = 0; s < len; s++){
+                for(j = 0; j < nc; j++) res[(size_t) s * stride + h * nc + j] *= y[s * nc + j];
+            }
+        }
+    }
+}
+
+
+#ifdef PHANGORN_X86
+// nc = 4, the 4 states of a rate category fill one register
+__attribute__((target("avx2,fma")))
+static void kernelSite4_avx2(const double *X, const double *PT, size_t pstride,
+    int len, int stride, int k, int nc, double *res, double *y, int op){
+    int s, h;
+    const double *x, *p;
+    double *r;
+    __m256d v;
+    (void) nc; // always 4, no scratch space needed
+    (void) y;
+    for(s = 0; s < len; s++){
+        x = &X[(size_t) s * stride];
+        r = &res[(size_t) s * stride];
+        for(h = 0; h < k; h++){
+            p = &PT[h * pstride];
+            v = _mm256_mul_pd(_mm256_broadcast_sd(&x[4*h]), _mm256_loadu_pd(p));
+            v = _mm256_fmadd_pd(_mm256_broadcast_sd(&x[4*h + 1]), _mm256_loadu_pd(&p[4]), v);
+            v = _mm256_fmadd_pd(_mm256_broadcast_sd(&x[4*h + 2]), _mm256_loadu_pd(&p[8]), v);
+            v = _mm256_fmadd_pd(_mm256_broadcast_sd(&x[4*h + 3]), _mm256_loadu_pd(&p[12]), v);
+            if(op == KERNEL4_MULT) v = _mm256_mul_pd(_mm256_load_pd(&r[4*h]), v);
+            _mm256_store_pd(&r[4*h], v);
+        }
+    }
+}
+#endif
+
+
+static kernel4_fun kernel4_impl = NULL;
+static kernelSite_fun kernelSite4_impl = NULL;
+
+
+// select the kernels, has to be called before they are used from threads
+static void kernel4_init(void){
+    if(kernel4_impl == NULL){
+        kernel4_fun f = kernel4_scalar;
+        kernelSite_fun fs = kernelSite_scalar;
+#ifdef PHANGORN_X86
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+            f = kernel4_avx2;
+            fs = kernelSite4_avx2;
+        }
+        else if(__builtin_cpu_supports("sse2")) f = kernel4_sse2;
+#endif
+        kernelSite4_impl = fs;
+        kernel4_impl = f;
+    }
+}
+
+
+static void kernel4ld(const double *X, const double *P, int n, int ld,
+    double *res, int *sc, int op){
+    kernel4_init();
+    kernel4_impl(X, P, n, ld, res, sc, op);
+}
+
+
+static void kernel4(const double *X, const double *P, int nr, double *res,
+    int *sc, int op){
+    kernel4ld(X, P, nr, nr, res, sc, op);
+}
+
+
 // contrast to full dense matrix
 void matp(int *x, double *contrast, double *P, int *nr, int *nc, int *nrs, double *result){
     int i, j;
@@ -123,11 +625,10 @@ void rowMinScale(int *dat, int n,  int k, int *res){
 }
 
 
-void getP(double *eva, double *ev, double *evi, int m, double el, double w, double *result){
+// getP with scratch tmp of length m, can be used from threads
+static void getPw(double *eva, double *ev, double *evi, int m, double el, double w, double *tmp, double *result){
     int i, j, h;
     double res;
-    double *tmp;
-    tmp = (double *) R_alloc(m, sizeof(double));
     for(i = 0; i < m; i++) tmp[i] = exp(eva[i] * w * el);
     for(i = 0; i < m; i++){
         for(j = 0; j < m; j++){
@@ -139,6 +640,188 @@ void getP(double *eva, double *ev, double *evi, int m, double el, double w, doub
 }
 
 
+// derivative of getPw with respect to log(el)
+static void getdPw(double *eva, double *ev, double *evi, int m, double el, double w, double *tmp, double *result){
+    int i, j, h;
+    double res;
+    for(i = 0; i < m; i++) tmp[i] = (eva[i] * w * el) * exp(eva[i] * w * el);
+    for(i = 0; i < m; i++){
+        for(j = 0; j < m; j++){
+            res = 0.0;
+            for(h = 0; h < m; h++) res += ev[i + h*m] * tmp[h] * evi[h + j*m];
+            result[i+j*m] = res;
+        }
+    }
+}
+
+
+void getP(double *eva, double *ev, double *evi, int m, double el, double w, double *result){
+    double *tmp = (double *) R_alloc(m, sizeof(double));
+    getPw(eva, ev, evi, m, el, w, tmp, result);
+}
+
+
+// number of slots in the transition matrix cache
+#define NPSLOT(ctx) (2L * (ctx)->ntips * (ctx)->k)
+
+
+// prepare the transition matrix cache, all entries get invalidated if the
+// eigen system differs from the one the cache was filled with
+static void ll_ctx_eig(ll_ctx *ctx, double *eva, double *eve, double *evei){
+    int i, nc = ctx->nc, nslot = NPSLOT(ctx);
+    size_t nc2 = (size_t) nc * nc;
+    if(ctx->P == NULL){
+        ctx->P = (double *) malloc(nslot * nc2 * sizeof(double));
+        ctx->Pel = (double *) malloc(nslot * sizeof(double));
+        ctx->Pg = (double *) malloc(nslot * sizeof(double));
+        ctx->Peig = (double *) calloc(nc + 2 * nc2, sizeof(double));
+        ctx->Ptmp = (double *) malloc(nc * sizeof(double));
+        if(ctx->P == NULL || ctx->Pel == NULL || ctx->Pg == NULL ||
+           ctx->Peig == NULL || ctx->Ptmp == NULL)
+            error("could not allocate transition matrix cache");
+        for(i = 0; i < nslot; i++) ctx->Pel[i] = R_NaN;
+    }
+    if(memcmp(ctx->Peig, eva, nc * sizeof(double)) ||
+       memcmp(&ctx->Peig[nc], eve, nc2 * sizeof(double)) ||
+       memcmp(&ctx->Peig[nc + nc2], evei, nc2 * sizeof(double))){
+        memcpy(ctx->Peig, eva, nc * sizeof(double));
+        memcpy(&ctx->Peig[nc], eve, nc2 * sizeof(double));
+        memcpy(&ctx->Peig[nc + nc2], evei, nc2 * sizeof(double));
+        for(i = 0; i < nslot; i++) ctx->Pel[i] = R_NaN;
+        ll_ctx_dirty(ctx, -1L);
+    }
+}
+
+
+// transition matrix of the edge leading to node ch for rate category rate,
+// only recomputed if edge length or rate changed since the last call
+static double *getPctx(ll_ctx *ctx, int ch, int rate, double el, double g){
+    int i, j, h, m = ctx->nc, slot = ch + rate * 2L * ctx->ntips;
+    double res, *P, *tmp = ctx->Ptmp;
+    double *eva = ctx->Peig, *ev = &ctx->Peig[m], *evi = &ctx->Peig[m + m*m];
+    P = &ctx->P[(size_t) slot * m * m];
+    if(ctx->Pel[slot] == el && ctx->Pg[slot] == g) return P;
+    if(ctx->Tvalid != NULL) ctx->Tvalid[slot] = 0L;
+    for(i = 0; i < m; i++) tmp[i] = exp(eva[i] * g * el);
+    for(i = 0; i < m; i++){
+        for(j = 0; j < m; j++){
+            res = 0.0;
+            for(h = 0; h < m; h++) res += ev[i + h*m] * tmp[h] * evi[h + j*m];
+            P[i+j*m] = res;
+        }
+    }
+    ctx->Pel[slot] = el;
+    ctx->Pg[slot] = g;
+    return P;
+}
+
+
+// set the contrast matrix for the tip lookup tables, tables get invalidated
+// if it differs from the last call
+static void ll_ctx_contrast(ll_ctx *ctx, double *contrast, int nco){
+    int i, j, nc = ctx->nc, nslot = NPSLOT(ctx);
+    if(ctx->nco != nco){
+        free(ctx->contrast);
+        free(ctx->T);
+        free(ctx->TT);
+        free(ctx->Tvalid);
+        ctx->contrast = (double *) malloc((size_t) nco * nc * sizeof(double));
+        ctx->T = (double *) malloc((size_t) nslot * nco * nc * sizeof(double));
+        ctx->TT = (double *) malloc((size_t) nco * nco * nc * sizeof(double));
+        ctx->Tvalid = (int *) calloc(nslot, sizeof(int));
+        if(ctx->contrast == NULL || ctx->T == NULL || ctx->TT == NULL ||
+           ctx->Tvalid == NULL){
+            ctx->nco = 0L;
+            error("could not allocate tip lookup tables");
+        }
+        ctx->nco = nco;
+        memcpy(ctx->contrast, contrast, (size_t) nco * nc * sizeof(double));
+        ll_ctx_dirty(ctx, -1L);
+    }
+    else if(memcmp(ctx->contrast, contrast, (size_t) nco * nc * sizeof(double))){
+        memcpy(ctx->contrast, contrast, (size_t) nco * nc * sizeof(double));
+        memset(ctx->Tvalid, 0, nslot * sizeof(int));
+        ll_ctx_dirty(ctx, -1L);
+    }
+    else return;
+    // undetermined states, a tip with such a state has a vector of ones
+    free(ctx->und);
+    ctx->und = (int *) malloc(nco * sizeof(int));
+    if(ctx->und == NULL) error("could not allocate tip lookup tables");
+    ctx->nund = 0L;
+    for(i = 0; i < nco; i++){
+        ctx->und[i] = 1L;
+        for(j = 0; j < nc; j++) if(contrast[i + j * nco] != 1.0) ctx->und[i] = 0L;
+        ctx->nund += ctx->und[i];
+    }
+    ctx->rvalid = 0L;
+}
+
+
+// lookup table contrast %*% P for the edge leading to tip ch
+static double *getTctx(ll_ctx *ctx, int ch, int rate, double el, double g){
+    int nc = ctx->nc, nco = ctx->nco, slot = ch + rate * 2L * ctx->ntips;
+    double *P = getPctx(ctx, ch, rate, el, g);
+    double *T = &ctx->T[(size_t) slot * nco * nc];
+    if(!ctx->Tvalid[slot]){
+        F77_CALL(dgemm)("N", "N", &nco, &nc, &nc, &one, ctx->contrast, &nco, P, &nc, &zero, T, &nco FCONE FCONE);
+        ctx->Tvalid[slot] = 1L;
+    }
+    return T;
+}
+
+
+// result = T[x, ], rows of a lookup table selected by the tip states,
+// result has leading dimension ld
+static void tipLookup(int *x, double *T, int nr, int ld, int nc, int nco, double *result){
+    int i, j;
+    for(j = 0; j < nc; j++){
+        for(i = 0; i < nr; i++) result[i + j*ld] = T[x[i] - 1L + j*nco];
+    }
+}
+
+
+// result *= T[x, ]
+static void tipMult(int *x, double *T, int nr, int ld, int nc, int nco, double *result){
+    int i, j;
+    for(j = 0; j < nc; j++){
+        for(i = 0; i < nr; i++) result[i + j*ld] *= T[x[i] - 1L + j*nco];
+    }
+}
+
+
+// result /= T[x, ]
+static void tipDiv(int *x, double *T, int nr, int ld, int nc, int nco, double *result){
+    int i, j;
+    for(j = 0; j < nc; j++){
+        for(i = 0; i < nr; i++) result[i + j*ld] /= T[x[i] - 1L + j*nco];
+    }
+}
+
+
+// two tips below one node (cherry): table TT of all state pairs, so each site
+// needs one lookup instead of two lookups and a product
+static void cherryTable(double *T1, double *T2, int nc, int nco, double *TT){
+    int j, s1, s2, nco2 = nco * nco;
+    for(j = 0; j < nc; j++){
+        for(s2 = 0; s2 < nco; s2++){
+            for(s1 = 0; s1 < nco; s1++)
+                TT[s1 + s2*nco + j*nco2] = T1[s1 + j*nco] * T2[s2 + j*nco];
+        }
+    }
+}
+
+
+static void cherryLookup(int *x1, int *x2, double *TT, int nr, int ld, int nc,
+    int nco, double *result){
+    int i, j, nco2 = nco * nco;
+    for(j = 0; j < nc; j++){
+        for(i = 0; i < nr; i++)
+            result[i + j*ld] = TT[x1[i] - 1L + (x2[i] - 1L) * nco + j*nco2];
+    }
+}
+
+
 SEXP getPM(SEXP eig, SEXP nc, SEXP el, SEXP w){
     R_len_t i, j, nel, nw, k;
     int m=INTEGER(nc)[0], l=0;
@@ -171,31 +854,41 @@ SEXP getPM(SEXP eig, SEXP nc, SEXP el, SEXP w){
 }
 
 
-void lll(SEXP dlist, double *eva, double *eve, double *evei, double *el, double g, int *nr, int *nc, int *node, int *edge, int nTips, double *contrast, int nco, int n, int *scaleTmp, double *bf, double *TMP, double *ans){
+void lll(ll_ctx *ctx, int rate, SEXP dlist, double *el, double g, int *nr, int *nc, int *node, int *edge, int nTips, int nco, int n, int *scaleTmp, double *bf, double *TMP, double *ans){
     int  ni, ei, j, i, rc; //    R_len_t i, n = length(node);
-    double *rtmp, *P;
+    double *rtmp, *P, *T;
     ni = -1;
     rc = *nr * *nc;
     rtmp = (double *) R_alloc(*nr * *nc, sizeof(double));
-    P = (double *) R_alloc(*nc * *nc, sizeof(double));
     for(j=0; j < *nr; j++) scaleTmp[j] = 0L;
     for(i = 0; i < n; i++) {
-        getP(eva, eve, evei, *nc, el[i], g, P);
         ei = edge[i];
         if(ni != node[i]){
             if(ni>0)scaleMatrix(&ans[ni * rc], nr, nc, scaleTmp); // (ni-nTips)
             ni = node[i];
-            if(ei < nTips)
-                matp(INTEGER(VECTOR_ELT(dlist, ei)), contrast, P, nr, nc, &nco, &ans[ni * rc]);
-            else
+            if(ei < nTips){
+                T = getTctx(ctx, ei + 1L, rate, el[i], g);
+                if(i+1L < n && node[i+1L] == ni && edge[i+1L] < nTips && nco * nco < *nr){
+                    cherryTable(T, getTctx(ctx, edge[i+1L] + 1L, rate, el[i+1L], g), *nc, nco, ctx->TT);
+                    cherryLookup(INTEGER(VECTOR_ELT(dlist, ei)), INTEGER(VECTOR_ELT(dlist, edge[i+1L])),
+                        ctx->TT, *nr, *nr, *nc, nco, &ans[ni * rc]);
+                    i++;
+                }
+                else tipLookup(INTEGER(VECTOR_ELT(dlist, ei)), T, *nr, *nr, *nc, nco, &ans[ni * rc]);
+            }
+            else{
+                P = getPctx(ctx, ei + 1L, rate, el[i], g);
                 F77_CALL(dgemm)("N", "N", nr, nc, nc, &one, &ans[(ei-nTips) * rc], nr, P, nc, &zero, &ans[ni * rc], nr FCONE FCONE);
+            }
         }
         else {
             if(ei < nTips)
-                matp(INTEGER(VECTOR_ELT(dlist, ei)), contrast, P, nr, nc, &nco, rtmp);
-            else
+                tipMult(INTEGER(VECTOR_ELT(dlist, ei)), getTctx(ctx, ei + 1L, rate, el[i], g), *nr, *nr, *nc, nco, &ans[ni * rc]);
+            else{
+                P = getPctx(ctx, ei + 1L, rate, el[i], g);
                 F77_CALL(dgemm)("N", "N", nr, nc, nc, &one, &ans[(ei-nTips) * rc], nr, P, nc, &zero, rtmp, nr FCONE FCONE);
-            for(j=0; j < rc; j++) ans[ni * rc + j] *= rtmp[j];
+                for(j=0; j < rc; j++) ans[ni * rc + j] *= rtmp[j];
+            }
         }
     }
     scaleMatrix(&ans[ni * rc], nr, nc, scaleTmp);
@@ -203,338 +896,1435 @@ void lll(SEXP dlist, double *eva, double *eve, double *evei, double *el, double
 }
 
 
-// this seems to work perfectly
-void lll3(SEXP dlist, double *eva, double *eve, double *evei, double *el, double g, int *nr, int *nc, int *node, int *edge,
-    int nTips, double *contrast, int nco, int n, int *scaleTmp, double *bf, double *TMP, double *ans, int *SC){
-    int  ni, ei, j, i, rc; //    R_len_t i, n = length(node);
-    double *rtmp, *P;
-    ni = -1L;
-    rc = *nr * *nc;
-    rtmp = (double *) R_alloc(*nr * *nc, sizeof(double));
-    P = (double *) R_alloc(*nc * *nc, sizeof(double));
-    for(j=0; j < *nr; j++) scaleTmp[j] = 0L;
-    for(i = 0; i < n; i++) {
-        getP(eva, eve, evei, *nc, el[i], g, P);
+// tables of all edges for rate category rate: lookup tables for edges
+// leading to tips, transition matrices for internal edges
+static void lllTables(ll_ctx *ctx, int rate, double *el, double g, int *edge,
+    int nTips, int n, double **tab){
+    int i;
+    for(i = 0; i < n; i++){
+        if(edge[i] < nTips) tab[i] = getTctx(ctx, edge[i] + 1L, rate, el[i], g);
+        else tab[i] = getPctx(ctx, edge[i] + 1L, rate, el[i], g);
+    }
+}
+
+
+/*
+ * Site repeats: sites with identical states at all tips below a node have
+ * identical likelihood vectors at this node. The sites of a block get
+ * classes per node, numbered in order of first appearance, rep holds the
+ * first site of each class. Classes of a node are found by hashing the pairs
+ * (classes so far, class of the next child). They only depend on the data
+ * and the topology and are shared by all rate categories.
+ */
+#define REP_EMPTY -1L
+
+
+static void siteRepeats(int **X, int start, int len, int nr, int *node, int *edge,
+    int nTips, int n, int *cls, int *rep, int *u, int64_t *key, int *val, int hsize){
+    int i, s, h, ni, ei, uch, cnt, *c, *ch;
+    int64_t kk;
+    for(i = 0; i < n; i++){
         ei = edge[i];
-        if(ni != node[i]){
-// test for node[i+1]
-            if(ni>0)scaleMatrix(&ans[ni * rc], nr, nc, &SC[ni * *nr]); // (ni-nTips)
-            ni = node[i];
-            for(j=0; j < *nr; j++) SC[j + ni * *nr] = 0L;
-            if(ei < nTips)
-                matp(INTEGER(VECTOR_ELT(dlist, ei)), contrast, P, nr, nc, &nco, &ans[ni * rc]);
-            else{
-                F77_CALL(dgemm)("N", "N", nr, nc, nc, &one, &ans[(ei-nTips) * rc], nr, P, nc, &zero, &ans[ni * rc], nr FCONE FCONE);
-                for(j=0; j < *nr; j++) SC[ni * *nr + j] = SC[(ei-nTips) * *nr + j];
-            }
+        ni = node[i];
+        c = &cls[(size_t) ni * nr + start];
+        if(i == 0 || node[i - 1L] != ni){
+            for(s = 0; s < len; s++) c[s] = 0L;
         }
-        else {
-            if(ei < nTips)
-                matp(INTEGER(VECTOR_ELT(dlist, ei)), contrast, P, nr, nc, &nco, rtmp);
-            else{
-                F77_CALL(dgemm)("N", "N", nr, nc, nc, &one, &ans[(ei-nTips) * rc], nr, P, nc, &zero, rtmp, nr FCONE FCONE);
-                for(j=0; j < *nr; j++) SC[ni * *nr + j] += SC[(ei-nTips) * *nr + j];
+        if(ei < nTips){
+            ch = X[ei] + start;
+            uch = 0L;
+            for(s = 0; s < len; s++) if(ch[s] > uch) uch = ch[s];
+            uch++;
+        }
+        else{
+            ch = &cls[(size_t) (ei - nTips) * nr + start];
+            uch = u[ei - nTips];
+        }
+        for(h = 0; h < hsize; h++) key[h] = REP_EMPTY;
+        cnt = 0L;
+        for(s = 0; s < len; s++){
+            kk = (int64_t) c[s] * uch + ch[s];
+            h = (int) (((uint64_t) kk * 0x9E3779B97F4A7C15ULL) >> 32) & (hsize - 1L);
+            while(key[h] != REP_EMPTY && key[h] != kk) h = (h + 1L) & (hsize - 1L);
+            if(key[h] == REP_EMPTY){
+                key[h] = kk;
+                val[h] = cnt;
+                rep[(size_t) ni * nr + start + cnt] = s;
+                cnt++;
             }
-            for(j=0; j < rc; j++) ans[ni * rc + j] *= rtmp[j];
+            c[s] = val[h];
         }
+        u[ni] = cnt;
     }
-    scaleMatrix(&ans[ni * rc], nr, nc, &SC[ni * *nr]);
-    for(j=0; j < *nr; j++) scaleTmp[j] = SC[ni * *nr + j];
+}
 
-    F77_CALL(dgemv)("N", nr, nc, &one, &ans[ni * rc], nr, bf, &ONE, &zero, TMP, &ONE FCONE);
+
+// hash table size for siteRepeats, a power of 2 at least 2 * len
+static int repHashSize(int len){
+    int h = 16L;
+    while(h < 2L * len) h *= 2L;
+    return h;
 }
 
 
-SEXP PML0(SEXP dlist, SEXP EL, SEXP G, SEXP NR, SEXP NC, SEXP K, SEXP eig, SEXP bf, SEXP node, SEXP edge, SEXP NTips, SEXP nco, SEXP contrast, SEXP N){
-    int nr=INTEGER(NR)[0], nc=INTEGER(NC)[0], k=INTEGER(K)[0], i, indLL;
-    int nTips = INTEGER(NTips)[0], *SC;
-    double *g=REAL(G), *tmp; //, logScaleEPS;
-    SEXP TMP;
-    double *eva, *eve, *evei;
-    eva = REAL(VECTOR_ELT(eig, 0));
-    eve = REAL(VECTOR_ELT(eig, 1));
-    evei = REAL(VECTOR_ELT(eig, 2));
-    SC = (int *) R_alloc(nr * k, sizeof(int));
-
-    PROTECT(TMP = allocMatrix(REALSXP, nr, k)); // changed
-    tmp=REAL(TMP);
-    for(i=0; i<(k*nr); i++)tmp[i]=0.0;
-    indLL = nr * nc * nTips;
-    for(i=0; i<k; i++){
-        lll(dlist, eva, eve, evei, REAL(EL), g[i], &nr, &nc, INTEGER(node), INTEGER(edge), nTips, REAL(contrast), INTEGER(nco)[0], INTEGER(N)[0], &SC[nr * i], REAL(bf), &tmp[i*nr], &LL[indLL *i]);
+/*
+ * Undetermined sites: if all tips below a node have an undetermined state
+ * (und, a row of ones in contrast) at a site, the likelihood vector of the
+ * node is a vector of ones there and does not change the vector of the
+ * parent. flag marks the other (active) sites per internal node, cnt counts
+ * them for the block for internal nodes (cnt[ni]) and tips (cnt[nTips + ei]).
+ * Like the site repeats they only depend on data and topology.
+ */
+static void siteMasks(int **X, int start, int len, int nr, int *node, int *edge,
+    int nTips, int n, int *und, char *flag, int *cnt){
+    int i, s, c, ni, ei, *x;
+    char *f, *fc;
+    for(i = 0; i < n; i++){
+        ei = edge[i];
+        ni = node[i];
+        f = &flag[(size_t) ni * nr + start];
+        if(i == 0 || node[i - 1L] != ni) memset(f, 0, len);
+        if(ei < nTips){
+            x = X[ei] + start;
+            c = 0L;
+            for(s = 0; s < len; s++){
+                if(!und[x[s] - 1L]){
+                    f[s] = 1;
+                    c++;
+                }
+            }
+            cnt[nTips + ei] = c;
+        }
+        else{
+            fc = &flag[(size_t) (ei - nTips) * nr + start];
+            for(s = 0; s < len; s++) f[s] |= fc[s];
+        }
+        if(i == n - 1L || node[i + 1L] != ni){
+            c = 0L;
+            for(s = 0; s < len; s++) c += f[s];
+            cnt[ni] = c;
+        }
     }
-    // logScaleEPS = log(ScaleEPS);
-    for(i=0; i<(k*nr); i++) tmp[i] = LOG_SCALE_EPS * SC[i] + log(tmp[i]);
-    UNPROTECT(1);
-    return TMP;
 }
 
 
-SEXP PML4(SEXP dlist, SEXP EL, SEXP W, SEXP G, SEXP NR, SEXP NC, SEXP K, SEXP eig, SEXP bf, SEXP node, SEXP edge, SEXP NTips, SEXP nco, SEXP contrast, SEXP N){
-    int nr=INTEGER(NR)[0], nc=INTEGER(NC)[0], k=INTEGER(K)[0], i, j, indLL;
-    int nTips = INTEGER(NTips)[0], *SC, *sc;
-    double *g=REAL(G), *w=REAL(W), *tmp, *res;
-    SEXP TMP;
-    double *eva, *eve, *evei;
-    eva = REAL(VECTOR_ELT(eig, 0));
-    eve = REAL(VECTOR_ELT(eig, 1));
-    evei = REAL(VECTOR_ELT(eig, 2));
-    SC = (int *) R_alloc(nr * k, sizeof(int));
-    sc = (int *) R_alloc(nr, sizeof(int));
-    tmp = (double *) R_alloc(nr * k, sizeof(double));
-    PROTECT(TMP = allocVector(REALSXP, nr));
-
-    res=REAL(TMP);
-    for(i=0; i<(k*nr); i++)tmp[i]=0.0;
-    indLL = nr * nc * nTips;
-    for(i=0; i<k; i++){
-        lll3(dlist, eva, eve, evei, REAL(EL), g[i], &nr, &nc, INTEGER(node), INTEGER(edge), nTips, REAL(contrast), INTEGER(nco)[0], INTEGER(N)[0],  &SC[nr * i], REAL(bf), &tmp[i*nr], &LL[indLL *i], &SCM[nr * nTips * i]);
-    }
-    rowMinScale(SC, nr, k, sc);
-    for(i=0; i<nr; i++){
-        res[i]=0.0;
-        for(j=0;j<k;j++)res[i] += w[j] * exp(LOG_SCALE_EPS * SC[i+j*nr]) * tmp[i+j*nr];
+// scaleBlock computing the row sums column by column in chunks of 64 rows,
+// faster for long blocks
+static void scaleRows(double *X, int n, int ld, int nc, int *sc){
+    double sum[64];
+    int i, j, s0, m;
+    for(s0 = 0; s0 < n; s0 += 64){
+        m = n - s0 < 64 ? n - s0 : 64;
+        for(i = 0; i < m; i++) sum[i] = X[s0 + i];
+        for(j = 1; j < nc; j++){
+            for(i = 0; i < m; i++) sum[i] += X[s0 + i + j * ld];
+        }
+        for(i = 0; i < m; i++){
+            if(sum[i] < ScaleEPS) scaleBlock(X + s0 + i, 1L, ld, nc, sc + s0 + i);
+        }
     }
-    for(i=0; i<nr; i++) res[i] = log(res[i]) + LOG_SCALE_EPS * sc[i];
-    UNPROTECT(1);
-    return TMP;
-}
-
-//  LL /= (child P)
-//  child *= (LL *P)
-void moveLL5(double *LL, double *child, double *P, int *nr, int *nc, double *tmp){
-    int j;
-    F77_CALL(dgemm)("N", "N", nr, nc, nc, &one, child, nr, P, nc, &zero, tmp, nr FCONE FCONE);
-    for(j=0; j<(*nc * *nr); j++) LL[j]/=tmp[j];
-    F77_CALL(dgemm)("N", "N", nr, nc, nc, &one, LL, nr, P, nc, &zero, tmp, nr FCONE FCONE);
-    for(j=0; j<(*nc * *nr); j++) child[j] *= tmp[j];
 }
 
 
-// dad / child * P
-void helpDADI(double *dad, double *child, double *P, int nr, int nc, double *res){
-    F77_CALL(dgemm)("N", "N", &nr, &nc, &nc, &one, child, &nr, P, &nc, &zero, res, &nr FCONE FCONE);
-    for(int j=0; j<(nc * nr); j++) dad[j]/=res[j];
+// dst = child (set) or dst *= child for the child edge ei with table T, at
+// all sites (dense) or only at runs of sites flagged active (sparse). After
+// a product the rows of dst get rescaled.
+static void maskChild(double *T, int **X, int start, int len, int nr, int nc, int nTips,
+    int nco, int ei, double *ans, int *SC, char *mflag, int *und, int dense, int set,
+    double *dst, int *sc, double *rtmp){
+    int j, m, s, s0, rc = nr * nc, *x = NULL, *csc = NULL;
+    double *src = NULL;
+    char *f = NULL;
+    if(ei < nTips) x = X[ei] + start;
+    else{
+        src = &ans[(ei - nTips) * rc];
+        csc = &SC[(ei - nTips) * nr];
+        f = &mflag[(size_t) (ei - nTips) * nr + start];
+    }
+    for(s = 0; s < len; ){
+        // next run s0, ..., s - 1
+        if(dense){
+            s0 = 0L;
+            s = len;
+        }
+        else{
+            if(ei < nTips) while(s < len && und[x[s] - 1L]) s++;
+            else while(s < len && !f[s]) s++;
+            s0 = s;
+            if(ei < nTips) while(s < len && !und[x[s] - 1L]) s++;
+            else while(s < len && f[s]) s++;
+        }
+        m = s - s0;
+        if(m == 0L) break;
+        if(ei < nTips){
+            if(set){
+                tipLookup(x + s0, T, m, nr, nc, nco, dst + s0);
+                for(j = s0; j < s; j++) sc[j] = 0L;
+            }
+            else{
+                tipMult(x + s0, T, m, nr, nc, nco, dst + s0);
+                scaleRows(dst + s0, m, nr, nc, sc + s0);
+            }
+            continue;
+        }
+        if(nc == 4) kernel4ld(src + s0, T, m, nr, dst + s0, set ? NULL : sc + s0, set ? KERNEL4_SET : KERNEL4_MULT);
+        else if(set) F77_CALL(dgemm)("N", "N", &m, &nc, &nc, &one, src + s0, &nr, T, &nc, &zero, dst + s0, &nr FCONE FCONE);
+        else{
+            F77_CALL(dgemm)("N", "N", &m, &nc, &nc, &one, src + s0, &nr, T, &nc, &zero, rtmp, &m FCONE FCONE);
+            for(j = 0; j < nc; j++){
+                for(s0 = s - m; s0 < s; s0++) dst[s0 + j * nr] *= rtmp[s0 - s + m + j * m];
+            }
+            s0 = s - m;
+            scaleRows(dst + s0, m, nr, nc, sc + s0);
+        }
+        if(set) for(j = s0; j < s; j++) sc[j] = csc[j];
+        else for(j = s0; j < s; j++) sc[j] += csc[j];
+    }
 }
 
 
-// braucht Addition skalierte Werte
-void helpPrep(double *dad, double *child, double *eve, double *evi, int nr, int nc, double *tmp, double *res){
-    F77_CALL(dgemm)("N", "N", &nr, &nc, &nc, &one, child, &nr, eve, &nc, &zero, res, &nr FCONE FCONE);
-    F77_CALL(dgemm)("N", "N", &nr, &nc, &nc, &one, dad, &nr, evi, &nc, &zero, tmp, &nr FCONE FCONE);
-    for(int j=0; j<(nc * nr); j++) res[j]*=tmp[j];
+// children edges i0, ..., i1 - 1 of node ni if some children have many
+// undetermined sites (see siteMasks). Such children are only multiplied in
+// at runs of active sites, the vector of ones at the other sites does not
+// change the product. The other children are computed for all sites like in
+// lll3, the first of them sets the vector. Rows are rescaled after every
+// product at the sites it touched. rtmp is scratch space of len * nc.
+static void lll3Mask(double **tab, int **X, int start, int len, int nr, int nc,
+    int nTips, int nco, int *edge, int i0, int i1, int ni, double *ans, int *SC,
+    char *mflag, int *cnt, int *und, double *rtmp){
+    int i, j, s, na, ei, d, rc = nr * nc, *sc = &SC[ni * nr];
+    double *dst = &ans[ni * rc];
+    // the first dense child sets the vector, otherwise start with ones
+    for(d = i0; d < i1; d++){
+        ei = edge[d];
+        if(4L * cnt[ei < nTips ? nTips + ei : ei - nTips] > 3L * len) break;
+    }
+    if(d < i1) maskChild(tab[d], X, start, len, nr, nc, nTips, nco, edge[d], ans, SC, mflag,
+                         und, 1L, 1L, dst, sc, rtmp);
+    else{
+        for(j = 0; j < nc; j++){
+            for(s = 0; s < len; s++) dst[s + j * nr] = 1.0;
+        }
+        for(s = 0; s < len; s++) sc[s] = 0L;
+    }
+    for(i = i0; i < i1; i++){
+        ei = edge[i];
+        na = cnt[ei < nTips ? nTips + ei : ei - nTips];
+        if(i == d || na == 0L) continue;
+        maskChild(tab[i], X, start, len, nr, nc, nTips, nco, ei, ans, SC, mflag, und,
+                  4L * na > 3L * len, 0L, dst, sc, rtmp);
+    }
 }
 
-/*
-void helpDAD2(double *dad, int *child, double *contrast, double *P, int nr, int nc, int nco, double *res){
-    matp(child, contrast, P, &nr, &nc, &nco, res);
-    for(int j=0; j<(nc * nr); j++) res[j]=dad[j]/res[j];
-}
-*/
 
-void helpDAD5(double *dad, int *child, double *contrast, double *P, int nr, int nc, int nco, double *res){
-    matp(child, contrast, P, &nr, &nc, &nco, res);
-    for(int j=0; j<(nc * nr); j++) dad[j]/=res[j];
+// children edges i0, ..., i1 - 1 of node ni, computed only for the
+// representatives of the site repeats and copied to all sites of a class.
+// G and C are scratch space of uc * nc, isc of 2 * uc
+static void lll3Repeats(double **tab, int **X, int start, int len, int nr, int nc,
+    int nTips, int nco, int *edge, int i0, int i1, int ni, double *ans, int *SC,
+    int *cls, int *rep, int uc, double *rtmp, double *G, double *C, int *isc){
+    int i, j, c, s, ei, rc = nr * nc, *scc = isc, *xr = isc + uc, *csc;
+    double *src, *dst;
+    for(i = i0; i < i1; i++){
+        ei = edge[i];
+        if(ei < nTips){
+            for(c = 0; c < uc; c++) xr[c] = X[ei][start + rep[c]];
+            if(i == i0){
+                tipLookup(xr, tab[i], uc, uc, nc, nco, C);
+                for(c = 0; c < uc; c++) scc[c] = 0L;
+            }
+            else tipMult(xr, tab[i], uc, uc, nc, nco, C);
+        }
+        else{
+            src = &ans[(ei - nTips) * rc];
+            csc = &SC[(ei - nTips) * nr];
+            for(j = 0; j < nc; j++){
+                for(c = 0; c < uc; c++) G[c + j * uc] = src[rep[c] + j * nr];
+            }
+            if(nc == 4) kernel4ld(G, tab[i], uc, uc, C, NULL, i == i0 ? KERNEL4_SET : KERNEL4_MULT);
+            else if(i == i0) F77_CALL(dgemm)("N", "N", &uc, &nc, &nc, &one, G, &uc, tab[i], &nc, &zero, C, &uc FCONE FCONE);
+            else{
+                F77_CALL(dgemm)("N", "N", &uc, &nc, &nc, &one, G, &uc, tab[i], &nc, &zero, rtmp, &uc FCONE FCONE);
+                for(j = 0; j < uc * nc; j++) C[j] *= rtmp[j];
+            }
+            if(i == i0) for(c = 0; c < uc; c++) scc[c] = csc[rep[c]];
+            else for(c = 0; c < uc; c++) scc[c] += csc[rep[c]];
+        }
+    }
+    scaleBlock(C, uc, uc, nc, scc);
+    dst = &ans[ni * rc];
+    for(j = 0; j < nc; j++){
+        for(s = 0; s < len; s++) dst[s + j * nr] = C[cls[s] + j * uc];
+    }
+    for(s = 0; s < len; s++) SC[ni * nr + s] = scc[cls[s]];
 }
 
-/*
-SEXP getDAD2(SEXP dad, SEXP child, SEXP contrast, SEXP P, SEXP nr, SEXP nc, SEXP nco){
-    R_len_t i, n=length(P);
-    int ncx=INTEGER(nc)[0], nrx=INTEGER(nr)[0], nrs=INTEGER(nco)[0]; //, j
-    SEXP TMP, RESULT;
-    PROTECT(RESULT = allocVector(VECSXP, n));
-    for(i=0; i<n; i++){
-        PROTECT(TMP = allocMatrix(REALSXP, nrx, ncx));
-        helpDAD2(REAL(VECTOR_ELT(dad, i)), INTEGER(child), REAL(contrast), REAL(VECTOR_ELT(P, i)), nrx, ncx, nrs, REAL(TMP));
-        SET_VECTOR_ELT(RESULT, i, TMP);
-        UNPROTECT(1); // TMP
+
+// this seems to work perfectly
+// lll3 for the block of site patterns start, ..., start + len - 1. Only the
+// tables tab, tip data X and the scratch space rtmp (len * nc) and
+// TT (nco * nco * nc) are used, so blocks can be computed in parallel.
+// If cls != NULL nodes with many site repeats are computed by lll3Repeats,
+// using the scratch space G, C (len * nc) and isc (2 * len).
+// If dirty != NULL only nodes with dirty[ni] != 0 are recomputed.
+// If mflag != NULL nodes with children with many undetermined sites are
+// computed by lll3Mask, mcnt are the counts of active sites of the block and
+// und marks the undetermined states.
+static void lll3(double **tab, int **X, int start, int len, int nr, int nc, int *node, int *edge,
+    int nTips, int nco, int n, int *scaleTmp, double *bf, double *TMP, double *ans, int *SC,
+    double *rtmp, double *TT, int *cls, int *rep, int *u, double *G, double *C, int *isc,
+    int *dirty, char *mflag, int *mcnt, int *und){
+    int  ni, ei, j, h, i, i1, rc, inner, scaled = 0L;
+    ni = -1L;
+    rc = nr * nc;
+    ans += start;
+    SC += start;
+    for(i = 0; i < n; i++) {
+        ei = edge[i];
+        if(ni != node[i]){
+            if(ni>0 && !scaled) scaleBlock(&ans[ni * rc], len, nr, nc, &SC[ni * nr]);
+            scaled = 0L;
+            ni = node[i];
+            // vectors still valid
+            if(dirty != NULL && !dirty[ni]){
+                while(i + 1L < n && node[i + 1L] == ni) i++;
+                scaled = 1L;
+                continue;
+            }
+            // enough site repeats and at least one internal child
+            if(cls != NULL && 2L * u[ni] <= len){
+                inner = 0L;
+                for(i1 = i; i1 < n && node[i1] == ni; i1++) if(edge[i1] >= nTips) inner = 1L;
+                if(inner){
+                    lll3Repeats(tab, X, start, len, nr, nc, nTips, nco, edge, i, i1, ni, ans, SC,
+                        &cls[(size_t) ni * nr + start], &rep[(size_t) ni * nr + start], u[ni], rtmp, G, C, isc);
+                    scaled = 1L;
+                    i = i1 - 1L;
+                    continue;
+                }
+            }
+            // a child with at least a quarter of its sites undetermined
+            if(mflag != NULL){
+                inner = 0L;
+                for(i1 = i; i1 < n && node[i1] == ni; i1++){
+                    ei = edge[i1];
+                    if(4L * mcnt[ei < nTips ? nTips + ei : ei - nTips] <= 3L * len) inner = 1L;
+                }
+                ei = edge[i];
+                if(inner){
+                    lll3Mask(tab, X, start, len, nr, nc, nTips, nco, edge, i, i1, ni, ans, SC,
+                        mflag, mcnt, und, rtmp);
+                    scaled = 1L;
+                    i = i1 - 1L;
+                    continue;
+                }
+            }
+            for(j=0; j < len; j++) SC[j + ni * nr] = 0L;
+            if(ei < nTips){
+                // cherry, if the table of state pairs is smaller than the block
+                if(i+1L < n && node[i+1L] == ni && edge[i+1L] < nTips && nco * nco < len){
+                    cherryTable(tab[i], tab[i+1L], nc, nco, TT);
+                    cherryLookup(X[ei] + start, X[edge[i+1L]] + start, TT, len, nr, nc, nco, &ans[ni * rc]);
+                    i++;
+                }
+                else tipLookup(X[ei] + start, tab[i], len, nr, nc, nco, &ans[ni * rc]);
+            }
+            else{
+                if(nc == 4) kernel4ld(&ans[(ei-nTips) * rc], tab[i], len, nr, &ans[ni * rc], NULL, KERNEL4_SET);
+                else F77_CALL(dgemm)("N", "N", &len, &nc, &nc, &one, &ans[(ei-nTips) * rc], &nr, tab[i], &nc, &zero, &ans[ni * rc], &nr FCONE FCONE);
+                for(j=0; j < len; j++) SC[ni * nr + j] = SC[(ei-nTips) * nr + j];
+            }
         }
-    UNPROTECT(1); //RESULT
-    return(RESULT);
+        else {
+            if(ei < nTips) tipMult(X[ei] + start, tab[i], len, nr, nc, nco, &ans[ni * rc]);
+            else{
+                for(j=0; j < len; j++) SC[ni * nr + j] += SC[(ei-nTips) * nr + j];
+                // last child: product and scaling in one pass
+                if(nc == 4){
+                    scaled = (i == n-1L || node[i+1L] != ni);
+                    kernel4ld(&ans[(ei-nTips) * rc], tab[i], len, nr, &ans[ni * rc],
+                              scaled ? &SC[ni * nr] : NULL, KERNEL4_MULT);
+                }
+                else{
+                    F77_CALL(dgemm)("N", "N", &len, &nc, &nc, &one, &ans[(ei-nTips) * rc], &nr, tab[i], &nc, &zero, rtmp, &len FCONE FCONE);
+                    for(h=0; h < nc; h++){
+                        for(j=0; j < len; j++) ans[ni * rc + j + h * nr] *= rtmp[j + h * len];
+                    }
+                }
+            }
+        }
+    }
+    if(!scaled) scaleBlock(&ans[ni * rc], len, nr, nc, &SC[ni * nr]);
+    for(j=0; j < len; j++) scaleTmp[j] = SC[ni * nr + j];
+
+    F77_CALL(dgemv)("N", &len, &nc, &one, &ans[ni * rc], &nr, bf, &ONE, &zero, TMP, &ONE FCONE);
 }
-*/
 
-void helpPrep2(double *dad, int *child, double *contrast, double *evi, int nr, int nc, int nrs, double *res){
-    int i, j;
-    F77_CALL(dgemm)("N", "N", &nr, &nc, &nc, &one, dad, &nr, evi, &nc, &zero, res, &nr FCONE FCONE);
-    for(i = 0; i < nr; i++){
-        for(j = 0; j < nc; j++) res[i + j*nr] *= contrast[child[i] - 1L + j*nrs];
+
+// checksum (FNV-1a) of the tip data
+static uint64_t tipHash(int **X, int ntips, int nr){
+    int i, s;
+    uint64_t hash = 14695981039346656037ULL;
+    for(i = 0; i < ntips; i++){
+        for(s = 0; s < nr; s++) hash = (hash ^ (uint64_t) X[i][s]) * 1099511628211ULL;
     }
+    return hash;
 }
 
-/*
-SEXP getPrep2(SEXP dad, SEXP child, SEXP contrast, SEXP evi, SEXP nr, SEXP nc, SEXP nco){
-    R_len_t i, n=length(dad);
-    int ncx=INTEGER(nc)[0], nrx=INTEGER(nr)[0], ncs=INTEGER(nco)[0];
-    SEXP TMP, RESULT;
-    PROTECT(RESULT = allocVector(VECSXP, n));
-    for(i=0; i<n; i++){
-        PROTECT(TMP = allocMatrix(REALSXP, nrx, ncx));
-        helpPrep2(REAL(VECTOR_ELT(dad, i)), INTEGER(child), REAL(contrast),  REAL(evi), nrx, ncx, ncs, REAL(TMP));
-        SET_VECTOR_ELT(RESULT, i, TMP);
-        UNPROTECT(1);
-        }
-    UNPROTECT(1);
-    return(RESULT);
-}
-*/
 
-// child *= (dad * P)
-void goDown(double *dad, double *child, double *P, int nr, int nc, double *res){
-    F77_CALL(dgemm)("N", "N", &nr, &nc, &nc, &one, dad, &nr, P, &nc, &zero, res, &nr FCONE FCONE);
-    for(int j=0; j<(nc * nr); j++) child[j]*=res[j];
+// prepare the site repeats and masks of undetermined sites (if gaps) of a
+// context for the tree (node, edge) and the tip data with checksum hash,
+// they are kept if neither changed since the last call
+static void ll_ctx_repeats(ll_ctx *ctx, uint64_t hash, int *node, int *edge, int n, int blk,
+    int gaps){
+    int ntips = ctx->ntips, nr = ctx->nr, nblk = (nr + blk - 1L) / blk;
+    if(ctx->repeats && ctx->rcls == NULL){
+        ctx->rcls = (int *) malloc((size_t) nr * ntips * sizeof(int));
+        ctx->rrep = (int *) malloc((size_t) nr * ntips * sizeof(int));
+        if(ctx->rcls == NULL || ctx->rrep == NULL)
+            error("could not allocate site repeats");
+        ctx->rvalid = 0L;
+    }
+    if(gaps && ctx->mflag == NULL){
+        ctx->mflag = (char *) malloc((size_t) nr * ntips);
+        if(ctx->mflag == NULL)
+            error("could not allocate site masks");
+        ctx->rvalid = 0L;
+    }
+    if(ctx->rvalid && (ctx->rn != n || ctx->rblk != blk || ctx->rhash != hash ||
+       memcmp(ctx->redge, node, n * sizeof(int)) ||
+       memcmp(&ctx->redge[n], edge, n * sizeof(int)))) ctx->rvalid = 0L;
+    if(ctx->rvalid) return;
+    if(ctx->rn != n || ctx->rblk != blk){
+        free(ctx->redge);
+        free(ctx->ru);
+        free(ctx->mcnt);
+        ctx->redge = (int *) malloc(2L * n * sizeof(int));
+        ctx->ru = (int *) malloc((size_t) nblk * ntips * sizeof(int));
+        ctx->mcnt = (int *) malloc((size_t) nblk * 2L * ntips * sizeof(int));
+        if(ctx->redge == NULL || ctx->ru == NULL || ctx->mcnt == NULL){
+            ctx->rn = 0L;
+            error("could not allocate site repeats");
+        }
+        ctx->rn = n;
+        ctx->rblk = blk;
+    }
+    memcpy(ctx->redge, node, n * sizeof(int));
+    memcpy(&ctx->redge[n], edge, n * sizeof(int));
+    ctx->rhash = hash;
 }
 
-// dad *= (child * P)
-void goUp(double *dad, int *child, double *contrast, double *P, int nr, int nc, int nco, double *res){
-    matp(child, contrast, P, &nr, &nc, &nco, res);
-    for(int j=0; j<(nc * nr); j++) dad[j]*=res[j];
-}
 
-// , double *w
-void updateLLQ(SEXP dlist, int pa, int ch, double *eva, double *eve, double*evei,
-               double el, double *g, int nr,
-               int nc, int ntips, double *contrast, int nco, int k,
-               double *tmp, double *P){
-    int i;
-    if(ch>ntips){
-        for(i = 0; i < k; i++){
-            getP(eva, eve, evei, nc, el, g[i], P);
-            goDown(&LL[LINDEX(ch, i)], &LL[LINDEX(pa, i)], P, nr, nc, tmp);
+// Incremental evaluation: sets dirty[ni] for the internal nodes of the tree
+// (node, edge, el) whose likelihood vectors have to be recomputed. A node is
+// clean if it has the same children with the same edge lengths as in the
+// last evaluation, its vectors were not changed since and all its children
+// are clean. A change therefore only recomputes the path to the root.
+// The tree is stored in v for the next call.
+static void ll_ctx_changed(ll_ctx *ctx, ll_inc *v, int *node, int *edge, double *el,
+    double *g, int k, int n, uint64_t hash, int *dirty){
+    int i, i1, j, ni, ei, ntips = ctx->ntips, all;
+    if(v->vnode == NULL){
+        v->vnode = (int *) malloc(2L * ntips * sizeof(int));
+        v->vedge = (int *) malloc(2L * ntips * sizeof(int));
+        v->vel = (double *) malloc(2L * ntips * sizeof(double));
+        v->vstart = (int *) malloc(ntips * sizeof(int));
+        v->vcnt = (int *) malloc(ntips * sizeof(int));
+        v->vok = (int *) calloc(ntips, sizeof(int));
+        v->vg = (double *) malloc(ctx->k * sizeof(double));
+        if(v->vnode == NULL || v->vedge == NULL || v->vel == NULL || v->vstart == NULL ||
+           v->vcnt == NULL || v->vok == NULL || v->vg == NULL)
+            error("could not allocate likelihood context");
+        v->vk = 0L;
+    }
+    all = !ctx->incremental || v->vk != k || v->vhash != hash ||
+        memcmp(v->vg, g, k * sizeof(double));
+    for(i = 0; i < ntips; i++) dirty[i] = 1L;
+    for(i = 0; i < n; i = i1){
+        ni = node[i];
+        for(i1 = i; i1 < n && node[i1] == ni; i1++);
+        if(all || !v->vok[ni] || v->vcnt[ni] != i1 - i) continue;
+        dirty[ni] = 0L;
+        for(j = 0; j < i1 - i; j++){
+            ei = edge[i + j];
+            if(v->vedge[v->vstart[ni] + j] != ei || v->vel[v->vstart[ni] + j] != el[i + j] ||
+               (ei >= ntips && dirty[ei - ntips])){
+                dirty[ni] = 1L;
+                break;
+            }
         }
     }
-    else{
-        for(i = 0; i < k; i++){
-            getP(eva, eve, evei, nc, el, g[i], P);
-            goUp(&LL[LINDEX(pa, i)], INTEGER(VECTOR_ELT(dlist, ch-1L)), contrast, P, nr, nc, nco, tmp);
+    memcpy(v->vnode, node, n * sizeof(int));
+    memcpy(v->vedge, edge, n * sizeof(int));
+    memcpy(v->vel, el, n * sizeof(double));
+    memcpy(v->vg, g, k * sizeof(double));
+    for(i = 0; i < ntips; i++) v->vok[i] = 0L;
+    for(i = 0; i < n; i++){
+        ni = node[i];
+        if(i == 0 || node[i - 1L] != ni){
+            v->vstart[ni] = i;
+            v->vcnt[ni] = 0L;
+            v->vok[ni] = 1L;
         }
+        v->vcnt[ni]++;
     }
+    v->vk = k;
+    v->vhash = hash;
 }
 
 
-// double *w,
-void updateLL2(SEXP dlist, int pa, int ch, double *eva, double *eve, double*evei,
-    double el,  double *g, int nr,
-    int nc, int ntips, double *contrast, int nco, int k,
-    double *tmp, double *P){
-    int i;
+// site patterns per block if PML4 runs threaded, one block of a likelihood
+// vector has about LL_BLOCK_BYTES, so a node and its children stay in cache
+#define LL_BLOCK_BYTES 32768L
 
-    if(ch>ntips){
-        for(i = 0; i < k; i++){
-            getP(eva, eve, evei, nc, el, g[i], P);
-            goDown(&LL[LINDEX(pa, i)], &LL[LINDEX(ch, i)], P, nr, nc, tmp);
-         }
-    }
-    else{
-        for(i = 0; i < k; i++){
-            getP(eva, eve, evei, nc, el, g[i], P);
-            goUp(&LL[LINDEX(pa, i)], INTEGER(VECTOR_ELT(dlist, ch-1L)), contrast, P, nr, nc, nco, tmp);
-        }
-    }
+
+static int lllBlockSize(int nr, int nc, int nthreads){
+    int blk = (int) (LL_BLOCK_BYTES / ((long) sizeof(double) * nc));
+    int per_thread = (nr + nthreads - 1L) / nthreads;
+    if(per_thread < blk) blk = per_thread;
+    // multiple of 8, so SIMD kernels split the sites the same way as unblocked
+    blk = ((blk + 7L) / 8L) * 8L;
+    return blk < nr ? blk : nr;
 }
 
 
-void ExtractScale(int ch, int k, int *nr, int *ntips, double *res){
-    int i;
-    int j, blub, tmp;
-    for(i = 0; i < k; i++){
-        blub = LINDEX3(ch, i);
-        for(j=0; j< *nr; j++) res[j +i * *nr] = SCM[blub+j];
-    }
-    for(i = 0; i< *nr; i++){
-        tmp = res[i];
-        for(j = 1; j<k; j++){
-            if(res[i+j * *nr]<tmp)tmp = res[i+j * *nr];
-        }
-        for(j=0; j<k; j++) res[i+j * *nr] = pow(ScaleEPS, (res[i+j * *nr] - tmp));
+/*
+ * Single precision evaluation for screening many candidate trees, selected
+ * with the option "precision" of a context. Vectors and scaling counts are
+ * kept in LLf and SCf with their own incremental state, so LL, SCM and the
+ * incremental state of the double vectors stay valid for the last tree
+ * evaluated in double. Rows get
+ * rescaled after every child, as the range of a float would not cover the
+ * product of several children. Products use AVX2 if available (8 sites
+ * per register), the root is summed up in double. State spaces larger than
+ * PRODF_MAXNC, too many scaling events or underflow fall back to double.
+ */
+static void scaleRowF(float *res, int ld, int nc, int i, int *sc){
+    int j;
+    float tmp = 0.0f;
+    for(j = 0; j < nc; j++) tmp += res[i + j*ld];
+    while(tmp < (float) ScaleEPS && tmp > 0.0f){
+        for(j = 0; j < nc; j++) res[i + j*ld] *= (float) ScaleMAX;
+        sc[i] += 1L;
+        tmp *= (float) ScaleMAX;
     }
 }
 
 
-// in getDad
-// dad / child * P
-void helpDAD(double *dad, double *child, double *P, int nr, int nc, double *res){
-    F77_CALL(dgemm)("N", "N", &nr, &nc, &nc, &one, child, &nr, P, &nc, &zero, res, &nr FCONE FCONE);
-    for(int j=0; j<(nc * nr); j++) res[j]=dad[j]/res[j];
-}
+// sites per tile in prodF, the tiles of X and res stay in the L1 cache
+#define PRODF_TILE 256L
+// larger state spaces are always evaluated in double precision
+#define PRODF_MAXNC 24L
 
-//
-SEXP getDAD(SEXP dad, SEXP child, SEXP P, SEXP nr, SEXP nc){
-    R_len_t i, n=length(P);
-    int ncx=INTEGER(nc)[0], nrx=INTEGER(nr)[0]; //, j
-    SEXP TMP, RESULT;
-    PROTECT(RESULT = allocVector(VECSXP, n));
-    for(i=0; i<n; i++){
-        PROTECT(TMP = allocMatrix(REALSXP, nrx, ncx));
-        helpDAD(REAL(VECTOR_ELT(dad, i)), REAL(VECTOR_ELT(child, i)), REAL(VECTOR_ELT(P, i)), nrx, ncx, REAL(TMP));
-        SET_VECTOR_ELT(RESULT, i, TMP);
-        UNPROTECT(1); // TMP
+// res = X %*% P, or res *= X %*% P if mult, rows of res get rescaled and sc
+// is incremented. X and res are len x nc with leading dimension ld, tmp is
+// scratch space for PRODF_TILE * nc floats.
+static void prodF(const float *X, const float *P, int len, int ld, int nc, float *res,
+    int *sc, float *tmp, int mult){
+    int i, j, s, s0, n;
+    float p, *d;
+    const float *x;
+    for(s0 = 0; s0 < len; s0 += PRODF_TILE){
+        n = len - s0 < PRODF_TILE ? len - s0 : PRODF_TILE;
+        for(j = 0; j < nc; j++){
+            d = tmp + (size_t) j * PRODF_TILE;
+            for(s = 0; s < n; s++) d[s] = 0.0f;
+            for(i = 0; i < nc; i++){
+                p = P[i + j * nc];
+                x = X + s0 + (size_t) i * ld;
+                for(s = 0; s < n; s++) d[s] += x[s] * p;
+            }
+            if(mult) for(s = 0; s < n; s++) res[s0 + s + j * ld] *= d[s];
+            else for(s = 0; s < n; s++) res[s0 + s + j * ld] = d[s];
         }
-    UNPROTECT(1); //RESULT
-    return(RESULT);
+        for(s = s0; s < s0 + n; s++) scaleRowF(res, ld, nc, s, sc);
     }
+}
 
 
-SEXP getPrep(SEXP dad, SEXP child, SEXP eve, SEXP evi, SEXP nr, SEXP nc){
-    R_len_t i, n=length(dad);
-    int ncx=INTEGER(nc)[0], nrx=INTEGER(nr)[0]; //, j
-    double *tmp;
-    SEXP TMP, RESULT;
-    tmp = (double *) R_alloc(nrx*ncx, sizeof(double));
-    PROTECT(RESULT = allocVector(VECSXP, n));
-    for(i=0; i<n; i++){
-        PROTECT(TMP = allocMatrix(REALSXP, nrx, ncx));
-        helpPrep(REAL(VECTOR_ELT(dad, i)), REAL(VECTOR_ELT(child, i)), REAL(eve),  REAL(evi), nrx, ncx, tmp, REAL(TMP));
-        SET_VECTOR_ELT(RESULT, i, TMP);
-        UNPROTECT(1); // TMP
+// prodF for nc = 4, see kernel4
+static void prodF4_tail(const float *X, const float *P, int start, int n, int ld,
+    float *res, int *sc, int mult){
+    int i, j;
+    float x0, x1, x2, x3, y;
+    for(i = start; i < n; i++){
+        x0 = X[i];
+        x1 = X[i + ld];
+        x2 = X[i + 2*ld];
+        x3 = X[i + 3*ld];
+        for(j = 0; j < 4; j++){
+            y = x0 * P[4*j] + x1 * P[1 + 4*j] + x2 * P[2 + 4*j] + x3 * P[3 + 4*j];
+            if(mult) res[i + j*ld] *= y;
+            else res[i + j*ld] = y;
         }
-    UNPROTECT(1); //RESULT
-    return(RESULT);
+        scaleRowF(res, ld, 4L, i, sc);
+    }
 }
 
 
-void NR_d2f(double *eva, int nc, double el, double *w, double *g, double *X, int ld, int nr, double *f, double *res){
-    int i, j, k;
-    double *tmp;
-    tmp = (double *) R_alloc(nc, sizeof(double));
+static void prodF4_scalar(const float *X, const float *P, int n, int ld,
+    float *res, int *sc, int mult){
+    prodF4_tail(X, P, 0L, n, ld, res, sc, mult);
+}
 
-    for(k=0; k<nr; k++) res[k] = 0.0;
 
-    for(j=0;j<ld;j++){
-        for(i=0; i<nc ;i++) tmp[i] = (eva[i] * g[j]) * exp(eva[i] * g[j] * el);
-        F77_CALL(dgemv)("N", &nr, &nc, &w[j], &X[j*(nr*nc)], &nr, tmp, &ONE, &one, res, &ONE FCONE);
+#ifdef PHANGORN_X86
+__attribute__((target("avx2,fma")))
+static void prodF4_avx2(const float *X, const float *P, int n, int ld,
+    float *res, int *sc, int mult){
+    int i, j, h, nr8 = n - (n % 8);
+    __m256 x0, x1, x2, x3, y, sum, eps = _mm256_set1_ps((float) ScaleEPS);
+    for(i = 0; i < nr8; i += 8){
+        x0 = _mm256_loadu_ps(&X[i]);
+        x1 = _mm256_loadu_ps(&X[i + ld]);
+        x2 = _mm256_loadu_ps(&X[i + 2*ld]);
+        x3 = _mm256_loadu_ps(&X[i + 3*ld]);
+        sum = _mm256_setzero_ps();
+        for(j = 0; j < 4; j++){
+            y = _mm256_mul_ps(x0, _mm256_broadcast_ss(&P[4*j]));
+            y = _mm256_fmadd_ps(x1, _mm256_broadcast_ss(&P[1 + 4*j]), y);
+            y = _mm256_fmadd_ps(x2, _mm256_broadcast_ss(&P[2 + 4*j]), y);
+            y = _mm256_fmadd_ps(x3, _mm256_broadcast_ss(&P[3 + 4*j]), y);
+            if(mult) y = _mm256_mul_ps(_mm256_loadu_ps(&res[i + j*ld]), y);
+            _mm256_storeu_ps(&res[i + j*ld], y);
+            sum = _mm256_add_ps(sum, y);
         }
-    for(i=0; i<nr ;i++) res[i]/=f[i];
+        if(_mm256_movemask_ps(_mm256_cmp_ps(sum, eps, _CMP_LT_OQ))){
+            for(h = 0; h < 8; h++) scaleRowF(res, ld, 4L, i + h, sc);
+        }
+    }
+    prodF4_tail(X, P, nr8, n, ld, res, sc, mult);
 }
+#endif
 
 
-void NR_df(double *eva, int nc, double el, double *w, double *g, double *X, int ld, int nr, double *f, double *res){
-    int i, j, k;
-    double *tmp;
-    tmp = (double *) R_alloc(nc, sizeof(double));
-    for(k=0; k<nr; k++) res[k] = 0.0;
-    int nrc = (nc+1L) * nr;
-    for(j=0;j<ld;j++){
-        for(i=0; i<nc ;i++) tmp[i] = (eva[i] * g[j]  * el) * exp(eva[i] * g[j] * el);
-        F77_CALL(dgemv)("N", &nr, &nc, &w[j], &X[j*nrc], &nr, tmp, &ONE, &one, res, &ONE FCONE);
+#ifdef PHANGORN_X86
+// prodF for any nc, 8 sites at a time
+__attribute__((target("avx2,fma")))
+static void prodF_avx2(const float *X, const float *P, int len, int ld, int nc, float *res,
+    int *sc, float *tmp, int mult){
+    int i, j, h, s, nr8 = len - (len % 8);
+    __m256 y, sum, eps = _mm256_set1_ps((float) ScaleEPS);
+    for(s = 0; s < nr8; s += 8){
+        sum = _mm256_setzero_ps();
+        for(j = 0; j < nc; j++){
+            y = _mm256_mul_ps(_mm256_loadu_ps(&X[s]), _mm256_broadcast_ss(&P[j * nc]));
+            for(i = 1; i < nc; i++)
+                y = _mm256_fmadd_ps(_mm256_loadu_ps(&X[s + (size_t) i * ld]), _mm256_broadcast_ss(&P[i + j * nc]), y);
+            if(mult) y = _mm256_mul_ps(_mm256_loadu_ps(&res[s + (size_t) j * ld]), y);
+            _mm256_storeu_ps(&res[s + (size_t) j * ld], y);
+            sum = _mm256_add_ps(sum, y);
         }
-    for(i=0; i<nr ;i++) res[i]/=f[i];
+        if(_mm256_movemask_ps(_mm256_cmp_ps(sum, eps, _CMP_LT_OQ))){
+            for(h = 0; h < 8; h++) scaleRowF(res, ld, nc, s + h, sc);
+        }
+    }
+    if(nr8 < len) prodF(X + nr8, P, len - nr8, ld, nc, res + nr8, sc + nr8, tmp, mult);
 }
+#endif
 
 
-// tmp ausserhalb?
-void NR_f(double *eva, int nc, double el, double *w, double *g, double *X, int ld, int nr, double *res){
-    int i, j;
-    double *tmp; //*res,  *dF,
-    tmp = (double *) R_alloc(nc, sizeof(double));
-    for(j=0;j<ld;j++){
-        for(i=0; i<nc ;i++) tmp[i] = exp(eva[i] * g[j] * el);
-        // alpha = w[j]
-        F77_CALL(dgemv)("N", &nr, &nc, &w[j], &X[j*nr*nc], &nr, tmp, &ONE, &one, res, &ONE FCONE);
+typedef void (*prodF4_fun)(const float *, const float *, int, int, float *, int *, int);
+typedef void (*prodF_fun)(const float *, const float *, int, int, int, float *, int *, float *, int);
+static prodF4_fun prodF4_impl = NULL;
+static prodF_fun prodF_impl = NULL;
+
+
+// select the kernels, has to be called before they are used from threads
+static void prodF4_init(void){
+    if(prodF4_impl == NULL){
+        prodF4_fun f = prodF4_scalar;
+        prodF_fun fn = prodF;
+#ifdef PHANGORN_X86
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+            f = prodF4_avx2;
+            fn = prodF_avx2;
+        }
+#endif
+        prodF_impl = fn;
+        prodF4_impl = f;
     }
 }
 
 
+// lll3 in single precision for the block start, ..., start + len - 1, only
+// nodes with dirty[ni] != 0 are recomputed
+static void lllF(float **tab, int **X, int start, int len, int nr, int nc, int *node,
+    int *edge, int nTips, int nco, int n, int *scaleTmp, double *bf, double *TMP,
+    float *ans, int *SC, float *rtmp, int *dirty){
+    int ni = -1L, ei, i, j, s, rc = nr * nc, *x;
+    double r;
+    ans += start;
+    SC += start;
+    for(i = 0; i < n; i++){
+        ei = edge[i];
+        if(ni != node[i]){
+            ni = node[i];
+            if(!dirty[ni]){
+                while(i + 1L < n && node[i + 1L] == ni) i++;
+                continue;
+            }
+            if(ei < nTips){
+                x = X[ei] + start;
+                for(j = 0; j < nc; j++){
+                    for(s = 0; s < len; s++) ans[ni * rc + s + j * nr] = tab[i][x[s] - 1L + j * nco];
+                }
+                for(s = 0; s < len; s++) SC[ni * nr + s] = 0L;
+            }
+            else{
+                for(s = 0; s < len; s++) SC[ni * nr + s] = SC[(ei - nTips) * nr + s];
+                if(nc == 4) prodF4_impl(&ans[(ei - nTips) * rc], tab[i], len, nr, &ans[ni * rc], &SC[ni * nr], 0L);
+                else prodF_impl(&ans[(ei - nTips) * rc], tab[i], len, nr, nc, &ans[ni * rc], &SC[ni * nr], rtmp, 0L);
+            }
+        }
+        else{
+            if(ei < nTips){
+                x = X[ei] + start;
+                for(j = 0; j < nc; j++){
+                    for(s = 0; s < len; s++) ans[ni * rc + s + j * nr] *= tab[i][x[s] - 1L + j * nco];
+                }
+                for(s = 0; s < len; s++) scaleRowF(&ans[ni * rc], nr, nc, s, &SC[ni * nr]);
+            }
+            else{
+                for(s = 0; s < len; s++) SC[ni * nr + s] += SC[(ei - nTips) * nr + s];
+                if(nc == 4) prodF4_impl(&ans[(ei - nTips) * rc], tab[i], len, nr, &ans[ni * rc], &SC[ni * nr], 1L);
+                else prodF_impl(&ans[(ei - nTips) * rc], tab[i], len, nr, nc, &ans[ni * rc], &SC[ni * nr], rtmp, 1L);
+            }
+        }
+    }
+    for(s = 0; s < len; s++){
+        scaleTmp[s] = SC[ni * nr + s];
+        r = 0.0;
+        for(j = 0; j < nc; j++) r += bf[j] * (double) ans[ni * rc + s + j * nr];
+        TMP[s] = r;
+    }
+}
+
+
+// PML4 in single precision, tab are the tables of lllTables. Like in double
+// precision only the vectors changed since the last evaluation in single
+// precision get recomputed. Returns 0 if there were too many scaling events
+// or a site likelihood underflowed, res has to be computed in double
+// precision then.
+static int pmlFloat(ll_ctx *ctx, int **X, double **tab, double *el, double *g,
+    double *w, double *bf, int *node, int *edge, int n, int k, uint64_t hash, double *res){
+    int nr = ctx->nr, nc = ctx->nc, nco = ctx->nco, ntips = ctx->ntips;
+    int i, h, s, m, nthreads = ctx->nthreads, blk, nblk, b, *SC, *dirty, ok = 1L;
+    size_t ntab = (size_t) nc * (nco > nc ? nco : nc), nLL = (size_t) nr * nc * ntips;
+    double *tmp, events = 0.0, r;
+    float **tabf, *scratch;
+    // BLAS in double is faster for large state spaces
+    if(nc > PRODF_MAXNC) return 0L;
+    if(ctx->LLf == NULL){
+        ctx->LLf = (float *) malloc(nLL * ctx->k * sizeof(float));
+        ctx->SCf = (int *) malloc((size_t) nr * ntips * ctx->k * sizeof(int));
+        if(ctx->LLf == NULL || ctx->SCf == NULL){
+            free(ctx->LLf);
+            free(ctx->SCf);
+            ctx->LLf = NULL;
+            ctx->SCf = NULL;
+            return 0L;
+        }
+        ll_inc_dirty(&ctx->incf, -1L, ntips);
+    }
+    dirty = (int *) R_alloc(ntips, sizeof(int));
+    ll_ctx_changed(ctx, &ctx->incf, node, edge, el, g, k, n, hash, dirty);
+    // only the tables of the children of dirty nodes are needed
+    tabf = (float **) R_alloc(n * k, sizeof(float *));
+    tabf[0] = (float *) R_alloc(ntab * n * k, sizeof(float));
+    for(i = 0; i < n * k; i++){
+        tabf[i] = tabf[0] + ntab * i;
+        if(!dirty[node[i % n]]) continue;
+        m = edge[i % n] < ntips ? nco * nc : nc * nc;
+        for(s = 0; s < m; s++) tabf[i][s] = (float) tab[i][s];
+    }
+    SC = (int *) R_alloc(nr * k, sizeof(int));
+    tmp = (double *) R_alloc(nr * k, sizeof(double));
+    blk = nthreads > 1L ? lllBlockSize(nr, nc, nthreads) : nr;
+    nblk = (nr + blk - 1L) / blk;
+    if(nblk < nthreads) nthreads = nblk;
+    scratch = (float *) R_alloc((size_t) PRODF_TILE * nc * nthreads, sizeof(float));
+    prodF4_init();
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1) if(nthreads > 1)
+#endif
+    for(b = 0; b < nblk; b++){
+        int hh, start = b * blk, len = nr - start < blk ? nr - start : blk;
+        float *rtmp = scratch;
+#ifdef _OPENMP
+        rtmp += (size_t) PRODF_TILE * nc * omp_get_thread_num();
+#endif
+        for(hh = 0; hh < k; hh++){
+            lllF(&tabf[n * hh], X, start, len, nr, nc, node, edge, ntips, nco, n,
+                 &SC[nr * hh + start], bf, &tmp[nr * hh + start], &ctx->LLf[nLL * hh],
+                 &ctx->SCf[(size_t) nr * ntips * hh], rtmp, dirty);
+        }
+    }
+    for(i = 0; i < nr * k; i++){
+        events += SC[i];
+        if(!(tmp[i] > 0.0)) ok = 0L;
+    }
+    if(!ok || events > (double) ctx->fscale * nr * k) return 0L;
+    for(s = 0; s < nr; s++){
+        m = SC[s];
+        for(h = 1; h < k; h++) if(SC[s + h*nr] < m) m = SC[s + h*nr];
+        r = 0.0;
+        for(h = 0; h < k; h++) r += w[h] * exp(LOG_SCALE_EPS * (SC[s+h*nr] - m)) * tmp[s+h*nr];
+        res[s] = log(r) + LOG_SCALE_EPS * m;
+    }
+    ctx->nfloat++;
+    return 1L;
+}
+
+
+// tables for the site major layout: rows of contrast %*% P for edges leading
+// to tips and rows of P for internal edges, each in a slot of m * nc doubles
+static void lllTablesSite(ll_ctx *ctx, int rate, double *el, double g, int *edge,
+    int nTips, int n, int m, double *tab){
+    int i, j, h, nc = ctx->nc, nco = ctx->nco;
+    double *T, *R;
+    for(i = 0; i < n; i++){
+        R = &tab[(size_t) i * m * nc];
+        if(edge[i] < nTips){
+            T = getTctx(ctx, edge[i] + 1L, rate, el[i], g);
+            for(h = 0; h < nco; h++){
+                for(j = 0; j < nc; j++) R[h * nc + j] = T[h + j * nco];
+            }
+        }
+        else{
+            T = getPctx(ctx, edge[i] + 1L, rate, el[i], g);
+            for(h = 0; h < nc; h++){
+                for(j = 0; j < nc; j++) R[h * nc + j] = T[h + j * nc];
+            }
+        }
+    }
+}
+
+
+// likelihood vectors in site major layout for the sites start, ...,
+// start + len - 1, blocks of sites can be computed in parallel.
+// y is scratch space of length nc * len, returns the index of the root.
+// If dirty != NULL only nodes with dirty[ni] != 0 are recomputed.
+static int lllSite(ll_ctx *ctx, double *tab, int m, int **X, int start, int len,
+    int k, int *node, int *edge, int nTips, int n, double *y, int *dirty){
+    int i, j, s, h, ni = -1L, ei, op, nr = ctx->nr, nc = ctx->nc, stride = ctx->sstride;
+    int kc = k * nc, *sc, *csc;
+    size_t pstride = (size_t) n * m * nc, nsite = (size_t) nr * stride;
+    double *dst, *src, *PT, *row, tmp;
+    kernelSite_fun kern = (nc == 4) ? kernelSite4_impl : kernelSite_blas;
+    for(i = 0; i < n; i++){
+        ei = edge[i];
+        op = KERNEL4_MULT;
+        if(ni != node[i]){
+            ni = node[i];
+            op = KERNEL4_SET;
+        }
+        if(dirty != NULL && !dirty[ni]) continue;
+        dst = &ctx->LL[ni * nsite + (size_t) start * stride];
+        sc = &ctx->SCM[(size_t) ni * nr + start];
+        PT = &tab[(size_t) i * m * nc];
+        if(ei < nTips){
+            for(s = 0; s < len; s++){
+                for(h = 0; h < k; h++){
+                    row = &PT[h * pstride + (X[ei][start + s] - 1L) * nc];
+                    if(op == KERNEL4_SET) for(j = 0; j < nc; j++) dst[s * stride + h * nc + j] = row[j];
+                    else for(j = 0; j < nc; j++) dst[s * stride + h * nc + j] *= row[j];
+                }
+            }
+            if(op == KERNEL4_SET) for(s = 0; s < len; s++) sc[s] = 0L;
+        }
+        else{
+            src = &ctx->LL[(ei - nTips) * nsite + (size_t) start * stride];
+            csc = &ctx->SCM[(size_t) (ei - nTips) * nr + start];
+            kern(src, PT, pstride, len, stride, k, nc, dst, y, op);
+            if(op == KERNEL4_SET) for(s = 0; s < len; s++) sc[s] = csc[s];
+            else for(s = 0; s < len; s++) sc[s] += csc[s];
+        }
+        // all children done, one scaling count for all rate categories
+        if(i == n - 1L || node[i + 1L] != ni){
+            for(s = 0; s < len; s++){
+                tmp = 0.0;
+                for(j = 0; j < kc; j++) tmp += dst[s * stride + j];
+                while(tmp < ScaleEPS && tmp > 0.0){
+                    for(j = 0; j < kc; j++) dst[s * stride + j] *= ScaleMAX;
+                    sc[s] += 1L;
+                    tmp *= ScaleMAX;
+                }
+            }
+        }
+    }
+    return ni;
+}
+
+
+// PML4 (w != NULL, site log-likelihoods) and PML0 (w == NULL, site
+// log-likelihoods per rate category) for the site major layout
+static void pmlSite(ll_ctx *ctx, SEXP dlist, double *el, double *g, double *w,
+    double *bf, int *node, int *edge, int nTips, int n, int k, double *res){
+    int i, nthreads, blk, nblk, b, nr = ctx->nr, nc = ctx->nc, nco = ctx->nco;
+    int m = nco > nc ? nco : nc, stride = ctx->sstride, **X, *dirty;
+    double *tab, *scratch;
+    X = (int **) R_alloc(nTips, sizeof(int *));
+    for(i=0; i<nTips; i++) X[i] = INTEGER(VECTOR_ELT(dlist, i));
+    dirty = (int *) R_alloc(ctx->ntips, sizeof(int));
+    ll_ctx_changed(ctx, &ctx->inc, node, edge, el, g, k, n, tipHash(X, nTips, nr), dirty);
+    tab = (double *) R_alloc((size_t) k * n * m * nc, sizeof(double));
+    for(i=0; i<k; i++) lllTablesSite(ctx, i, el, g[i], edge, nTips, n, m, &tab[(size_t) i * n * m * nc]);
+    kernel4_init();
+
+    nthreads = ctx->nthreads;
+    blk = nthreads > 1L ? lllBlockSize(nr, stride, nthreads) : nr;
+    nblk = (nr + blk - 1L) / blk;
+    if(nblk < nthreads) nthreads = nblk;
+    scratch = (double *) R_alloc((size_t) nc * blk * nthreads, sizeof(double));
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1) if(nthreads > 1)
+#endif
+    for(b=0; b<nblk; b++){
+        int h, j, s, root, start = b * blk, len = nr - start < blk ? nr - start : blk;
+        double *y = scratch, *x, r, tmp;
+#ifdef _OPENMP
+        y += (size_t) nc * blk * omp_get_thread_num();
+#endif
+        root = lllSite(ctx, tab, m, X, start, len, k, node, edge, nTips, n, y, dirty);
+        for(s=start; s<start+len; s++){
+            x = &ctx->LL[((size_t) root * nr + s) * stride];
+            r = 0.0;
+            for(h=0; h<k; h++){
+                tmp = 0.0;
+                for(j=0; j<nc; j++) tmp += bf[j] * x[h * nc + j];
+                if(w != NULL) r += w[h] * tmp;
+                else res[s + h * nr] = log(tmp) + LOG_SCALE_EPS * ctx->SCM[(size_t) root * nr + s];
+            }
+            if(w != NULL) res[s] = log(r) + LOG_SCALE_EPS * ctx->SCM[(size_t) root * nr + s];
+        }
+    }
+}
+
+
+SEXP PML0(SEXP dlist, SEXP EL, SEXP G, SEXP NR, SEXP NC, SEXP K, SEXP eig, SEXP bf, SEXP node, SEXP edge, SEXP NTips, SEXP nco, SEXP contrast, SEXP N, SEXP CTX){
+    int nr=INTEGER(NR)[0], nc=INTEGER(NC)[0], k=INTEGER(K)[0], i, indLL;
+    int nTips = INTEGER(NTips)[0], *SC;
+    double *g=REAL(G), *tmp; //, logScaleEPS;
+    SEXP TMP;
+    double *eva, *eve, *evei;
+    ll_ctx *ctx = getLLCtx(CTX, nr, nTips, nc, k);
+    eva = REAL(VECTOR_ELT(eig, 0));
+    eve = REAL(VECTOR_ELT(eig, 1));
+    evei = REAL(VECTOR_ELT(eig, 2));
+    SC = (int *) R_alloc(nr * k, sizeof(int));
+
+    PROTECT(TMP = allocMatrix(REALSXP, nr, k)); // changed
+    tmp=REAL(TMP);
+    for(i=0; i<(k*nr); i++)tmp[i]=0.0;
+    ll_ctx_eig(ctx, eva, eve, evei);
+    ll_ctx_contrast(ctx, REAL(contrast), INTEGER(nco)[0]);
+    if(ctx->layout == LL_SITE_MAJOR){
+        pmlSite(ctx, dlist, REAL(EL), g, NULL, REAL(bf), INTEGER(node), INTEGER(edge), nTips, INTEGER(N)[0], k, tmp);
+        UNPROTECT(1);
+        return TMP;
+    }
+    indLL = nr * nc * ctx->ntips;
+    for(i=0; i<k; i++){
+        lll(ctx, i, dlist, REAL(EL), g[i], &nr, &nc, INTEGER(node), INTEGER(edge), nTips, INTEGER(nco)[0], INTEGER(N)[0], &SC[nr * i], REAL(bf), &tmp[i*nr], &ctx->LL[indLL *i]);
+    }
+    // scaling counts are not stored, so the vectors can't be reused by PML4
+    ll_ctx_dirty(ctx, -1L);
+    // logScaleEPS = log(ScaleEPS);
+    for(i=0; i<(k*nr); i++) tmp[i] = LOG_SCALE_EPS * SC[i] + log(tmp[i]);
+    UNPROTECT(1);
+    return TMP;
+}
+
+
+SEXP PML4(SEXP dlist, SEXP EL, SEXP W, SEXP G, SEXP NR, SEXP NC, SEXP K, SEXP eig, SEXP bf, SEXP node, SEXP edge, SEXP NTips, SEXP nco, SEXP contrast, SEXP N, SEXP CTX){
+    int nr=INTEGER(NR)[0], nc=INTEGER(NC)[0], k=INTEGER(K)[0], i, indLL;
+    int nTips = INTEGER(NTips)[0], ncox = INTEGER(nco)[0], n = INTEGER(N)[0];
+    int *SC, **X, nthreads, blk, nblk, b, *nodes=INTEGER(node), *edges=INTEGER(edge);
+    int *rscratch = NULL, rnew = 0L, hsize = 0L, *dirty, gaps;
+    uint64_t hash;
+    double *g=REAL(G), *w=REAL(W), *bfs=REAL(bf), *tmp, *res, **tab, *scratch;
+    size_t nscratch, nrscratch = 0L;
+    SEXP TMP;
+    double *eva, *eve, *evei;
+    ll_ctx *ctx = getLLCtx(CTX, nr, nTips, nc, k);
+    eva = REAL(VECTOR_ELT(eig, 0));
+    eve = REAL(VECTOR_ELT(eig, 1));
+    evei = REAL(VECTOR_ELT(eig, 2));
+    SC = (int *) R_alloc(nr * k, sizeof(int));
+    tmp = (double *) R_alloc(nr * k, sizeof(double));
+    PROTECT(TMP = allocVector(REALSXP, nr));
+
+    res=REAL(TMP);
+    for(i=0; i<(k*nr); i++)tmp[i]=0.0;
+    ll_ctx_eig(ctx, eva, eve, evei);
+    ll_ctx_contrast(ctx, REAL(contrast), ncox);
+    if(ctx->layout == LL_SITE_MAJOR){
+        pmlSite(ctx, dlist, REAL(EL), g, w, bfs, nodes, edges, nTips, n, k, res);
+        UNPROTECT(1);
+        return TMP;
+    }
+    indLL = nr * nc * ctx->ntips;
+    // everything touching R or the caches is done before the site blocks
+    X = (int **) R_alloc(nTips, sizeof(int *));
+    for(i=0; i<nTips; i++) X[i] = INTEGER(VECTOR_ELT(dlist, i));
+    hash = tipHash(X, nTips, nr);
+    tab = (double **) R_alloc(n * k, sizeof(double *));
+    for(i=0; i<k; i++) lllTables(ctx, i, REAL(EL), g[i], edges, nTips, n, &tab[n * i]);
+    if(ctx->precision && pmlFloat(ctx, X, tab, REAL(EL), g, w, bfs, nodes, edges, n, k, hash, res)){
+        UNPROTECT(1);
+        return TMP;
+    }
+    dirty = (int *) R_alloc(ctx->ntips, sizeof(int));
+    ll_ctx_changed(ctx, &ctx->inc, nodes, edges, REAL(EL), g, k, n, hash, dirty);
+    kernel4_init();
+
+    nthreads = ctx->nthreads;
+    blk = nthreads > 1L ? lllBlockSize(nr, nc, nthreads) : nr;
+    nblk = (nr + blk - 1L) / blk;
+    if(nblk < nthreads) nthreads = nblk;
+    nscratch = (size_t) blk * nc + (size_t) ncox * ncox * nc;
+    gaps = ctx->gaps && ctx->nund > 0L;
+    if(ctx->repeats || gaps){
+        ll_ctx_repeats(ctx, hash, nodes, edges, n, blk, gaps);
+        nscratch += 2L * (size_t) blk * nc;
+        rnew = !ctx->rvalid;
+        hsize = ctx->repeats ? repHashSize(blk) : 0L;
+        nrscratch = 2L * (size_t) blk + (rnew ? 3L * hsize : 0L);
+        rscratch = (int *) R_alloc(nrscratch * nthreads, sizeof(int));
+    }
+    scratch = (double *) R_alloc(nscratch * nthreads, sizeof(double));
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1) if(nthreads > 1)
+#endif
+    for(b=0; b<nblk; b++){
+        int h, j, m, s, start = b * blk, len = nr - start < blk ? nr - start : blk;
+        double *rtmp = scratch, r;
+        int *isc = rscratch, *u = NULL, *mcnt = NULL;
+#ifdef _OPENMP
+        rtmp += nscratch * omp_get_thread_num();
+        if(isc != NULL) isc += nrscratch * omp_get_thread_num();
+#endif
+        if(ctx->repeats){
+            u = &ctx->ru[(size_t) b * ctx->ntips];
+            if(rnew) siteRepeats(X, start, len, nr, nodes, edges, nTips, n, ctx->rcls, ctx->rrep, u,
+                                 (int64_t *) (isc + 2L * blk), isc + 2L * blk + 2L * hsize, hsize);
+        }
+        if(gaps){
+            mcnt = &ctx->mcnt[(size_t) b * 2L * ctx->ntips];
+            if(rnew) siteMasks(X, start, len, nr, nodes, edges, nTips, n, ctx->und, ctx->mflag, mcnt);
+        }
+        for(h=0; h<k; h++){
+            lll3(&tab[n * h], X, start, len, nr, nc, nodes, edges, nTips, ncox, n,
+                 &SC[nr * h + start], bfs, &tmp[nr * h + start], &ctx->LL[indLL * h],
+                 &ctx->SCM[nr * ctx->ntips * h], rtmp, rtmp + (size_t) blk * nc,
+                 u == NULL ? NULL : ctx->rcls, ctx->rrep, u,
+                 rtmp + (size_t) blk * nc + (size_t) ncox * ncox * nc,
+                 rtmp + 2L * (size_t) blk * nc + (size_t) ncox * ncox * nc, isc, dirty,
+                 mcnt == NULL ? NULL : ctx->mflag, mcnt, ctx->und);
+        }
+        // sum over rate categories, relative to the smallest scaling count
+        for(s=start; s<start+len; s++){
+            m = SC[s];
+            for(h=1; h<k; h++) if(SC[s + h*nr] < m) m = SC[s + h*nr];
+            r = 0.0;
+            for(j=0; j<k; j++) r += w[j] * exp(LOG_SCALE_EPS * (SC[s+j*nr] - m)) * tmp[s+j*nr];
+            res[s] = log(r) + LOG_SCALE_EPS * m;
+        }
+    }
+    if(ctx->repeats || gaps) ctx->rvalid = 1L;
+    UNPROTECT(1);
+    return TMP;
+}
+
+/*
+ * Mixture of m components sharing one topology, evaluated in one traversal:
+ * every rate category of every component (with its own eigen system, base
+ * frequencies and edge lengths) is handled like an extra rate category of
+ * PML4. The likelihood vectors of a site block only live in a per thread
+ * buffer, so memory does not grow with the number of categories.
+ * EL is n x m, W and G lists with the weights and rates of each component,
+ * LL0 (nr x m) the likelihood of the invariable sites. Returns the nr x m
+ * matrix of log site likelihoods of the components.
+ */
+SEXP PMLMix(SEXP dlist, SEXP EL, SEXP W, SEXP G, SEXP NR, SEXP NC, SEXP eig, SEXP BF,
+            SEXP node, SEXP edge, SEXP NTips, SEXP nco, SEXP contrast, SEXP LL0,
+            SEXP THREADS){
+    int nr=INTEGER(NR)[0], nc=INTEGER(NC)[0], nTips = INTEGER(NTips)[0];
+    int ncox = INTEGER(nco)[0], m = length(eig), n = length(node);
+    int *nodes=INTEGER(node), *edges=INTEGER(edge), nthreads = INTEGER(THREADS)[0];
+    int i, c, q, K, blk, nblk, b, *comp, *first, *SC, *SCB, **X, **XB;
+    double *el = REAL(EL), *bfs = REAL(BF), *ll0 = REAL(LL0), *wq, *tmp, *res;
+    double *eva, *eve, *evei, *P, *Ptmp, **tab, *tables, *scratch;
+    size_t nc2 = (size_t) nc * nc, nt = (size_t) ncox * nc, nscratch;
+    SEXP RES;
+    if(length(W) != m || length(G) != m || ncols(EL) != m || ncols(BF) != m || ncols(LL0) != m)
+        error("all components need edge lengths, rates, weights and base frequencies");
+    // categories q of the components, comp[q] the component of q and
+    // first[c] the first category of component c
+    first = (int *) R_alloc(m + 1L, sizeof(int));
+    first[0] = 0L;
+    for(c = 0; c < m; c++) first[c + 1L] = first[c] + length(VECTOR_ELT(G, c));
+    K = first[m];
+    comp = (int *) R_alloc(K, sizeof(int));
+    wq = (double *) R_alloc(K, sizeof(double));
+    for(c = 0; c < m; c++){
+        for(q = first[c]; q < first[c + 1L]; q++){
+            comp[q] = c;
+            wq[q] = REAL(VECTOR_ELT(W, c))[q - first[c]];
+        }
+    }
+    X = (int **) R_alloc(nTips, sizeof(int *));
+    for(i=0; i<nTips; i++) X[i] = INTEGER(VECTOR_ELT(dlist, i));
+    // transition matrices of internal edges and tip tables for all categories
+    tab = (double **) R_alloc((size_t) n * K, sizeof(double *));
+    tables = (double *) R_alloc((size_t) n * K * (nc2 > nt ? nc2 : nt), sizeof(double));
+    P = (double *) R_alloc(nc2 + nc, sizeof(double));
+    Ptmp = P + nc2;
+    for(q = 0; q < K; q++){
+        c = comp[q];
+        eva = REAL(VECTOR_ELT(VECTOR_ELT(eig, c), 0));
+        eve = REAL(VECTOR_ELT(VECTOR_ELT(eig, c), 1));
+        evei = REAL(VECTOR_ELT(VECTOR_ELT(eig, c), 2));
+        for(i = 0; i < n; i++){
+            double *T = &tables[((size_t) q * n + i) * (nc2 > nt ? nc2 : nt)];
+            double gq = REAL(VECTOR_ELT(G, c))[q - first[c]];
+            tab[(size_t) q * n + i] = T;
+            if(edges[i] < nTips){
+                getPw(eva, eve, evei, nc, el[i + (size_t) c * n], gq, Ptmp, P);
+                F77_CALL(dgemm)("N", "N", &ncox, &nc, &nc, &one, REAL(contrast), &ncox, P, &nc, &zero, T, &ncox FCONE FCONE);
+            }
+            else getPw(eva, eve, evei, nc, el[i + (size_t) c * n], gq, Ptmp, T);
+        }
+    }
+    kernel4_init();
+
+    SC = (int *) R_alloc((size_t) nr * K, sizeof(int));
+    tmp = (double *) R_alloc((size_t) nr * K, sizeof(double));
+    PROTECT(RES = allocMatrix(REALSXP, nr, m));
+    res = REAL(RES);
+
+    if(nthreads < 1L) nthreads = 1L;
+    blk = lllBlockSize(nr, nc, nthreads);
+    nblk = (nr + blk - 1L) / blk;
+    if(nblk < nthreads) nthreads = nblk;
+    // per thread: vectors of all nodes for one block, product and cherry table
+    nscratch = (size_t) nTips * blk * nc + (size_t) blk * nc + (size_t) ncox * ncox * nc;
+    scratch = (double *) R_alloc(nscratch * nthreads, sizeof(double));
+    SCB = (int *) R_alloc((size_t) nTips * blk * nthreads, sizeof(int));
+    XB = (int **) R_alloc((size_t) nTips * nthreads, sizeof(int *));
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1) if(nthreads > 1)
+#endif
+    for(b=0; b<nblk; b++){
+        int h, j, mn, s, t = 0L, start = b * blk, len = nr - start < blk ? nr - start : blk;
+        double *ans, r, lv;
+        int **xb, *scb;
+#ifdef _OPENMP
+        t = omp_get_thread_num();
+#endif
+        ans = scratch + nscratch * t;
+        scb = SCB + (size_t) nTips * blk * t;
+        xb = XB + (size_t) nTips * t;
+        // the block is handled as an alignment of len sites
+        for(j = 0; j < nTips; j++) xb[j] = X[j] + start;
+        for(h = 0; h < K; h++){
+            lll3(&tab[(size_t) n * h], xb, 0L, len, len, nc, nodes, edges, nTips, ncox, n,
+                 &SC[(size_t) nr * h + start], &bfs[nc * comp[h]], &tmp[(size_t) nr * h + start],
+                 ans, scb, ans + (size_t) nTips * blk * nc,
+                 ans + (size_t) nTips * blk * nc + (size_t) blk * nc,
+                 NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+        }
+        // sum over the rate categories of each component
+        for(j = 0; j < m; j++){
+            for(s=start; s<start+len; s++){
+                mn = SC[s + (size_t) first[j] * nr];
+                for(h=first[j]+1L; h<first[j+1L]; h++) if(SC[s + (size_t) h*nr] < mn) mn = SC[s + (size_t) h*nr];
+                r = 0.0;
+                for(h=first[j]; h<first[j+1L]; h++)
+                    r += wq[h] * exp(LOG_SCALE_EPS * (SC[s + (size_t) h*nr] - mn)) * tmp[s + (size_t) h*nr];
+                lv = log(r) + LOG_SCALE_EPS * mn;
+                if(ll0[s + (size_t) j * nr] > 0.0) lv = log(exp(lv) + ll0[s + (size_t) j * nr]);
+                res[s + (size_t) j * nr] = lv;
+            }
+        }
+    }
+    UNPROTECT(1);
+    return RES;
+}
+
+
+//  LL /= (child P)
+//  child *= (LL *P)
+void moveLL5(double *LL, double *child, double *P, int *nr, int *nc, double *tmp){
+    int j;
+    if(*nc == 4){
+        kernel4(child, P, *nr, LL, NULL, KERNEL4_DIV);
+        kernel4(LL, P, *nr, child, NULL, KERNEL4_MULT);
+        return;
+    }
+    F77_CALL(dgemm)("N", "N", nr, nc, nc, &one, child, nr, P, nc, &zero, tmp, nr FCONE FCONE);
+    for(j=0; j<(*nc * *nr); j++) LL[j]/=tmp[j];
+    F77_CALL(dgemm)("N", "N", nr, nc, nc, &one, LL, nr, P, nc, &zero, tmp, nr FCONE FCONE);
+    for(j=0; j<(*nc * *nr); j++) child[j] *= tmp[j];
+}
+
+
+// dad / child * P
+void helpDADI(double *dad, double *child, double *P, int nr, int nc, double *res){
+    if(nc == 4){
+        kernel4(child, P, nr, dad, NULL, KERNEL4_DIV);
+        return;
+    }
+    F77_CALL(dgemm)("N", "N", &nr, &nc, &nc, &one, child, &nr, P, &nc, &zero, res, &nr FCONE FCONE);
+    for(int j=0; j<(nc * nr); j++) dad[j]/=res[j];
+}
+
+
+// braucht Addition skalierte Werte
+void helpPrep(double *dad, double *child, double *eve, double *evi, int nr, int nc, double *tmp, double *res){
+    F77_CALL(dgemm)("N", "N", &nr, &nc, &nc, &one, child, &nr, eve, &nc, &zero, res, &nr FCONE FCONE);
+    F77_CALL(dgemm)("N", "N", &nr, &nc, &nc, &one, dad, &nr, evi, &nc, &zero, tmp, &nr FCONE FCONE);
+    for(int j=0; j<(nc * nr); j++) res[j]*=tmp[j];
+}
+
+/*
+void helpDAD2(double *dad, int *child, double *contrast, double *P, int nr, int nc, int nco, double *res){
+    matp(child, contrast, P, &nr, &nc, &nco, res);
+    for(int j=0; j<(nc * nr); j++) res[j]=dad[j]/res[j];
+}
+*/
+
+// dad /= T[child, ], T lookup table of the tip
+void helpDAD5(double *dad, int *child, double *T, int nr, int nc, int nco){
+    tipDiv(child, T, nr, nr, nc, nco, dad);
+}
+
+/*
+SEXP getDAD2(SEXP dad, SEXP child, SEXP contrast, SEXP P, SEXP nr, SEXP nc, SEXP nco){
+    R_len_t i, n=length(P);
+    int ncx=INTEGER(nc)[0], nrx=INTEGER(nr)[0], nrs=INTEGER(nco)[0]; //, j
+    SEXP TMP, RESULT;
+    PROTECT(RESULT = allocVector(VECSXP, n));
+    for(i=0; i<n; i++){
+        PROTECT(TMP = allocMatrix(REALSXP, nrx, ncx));
+        helpDAD2(REAL(VECTOR_ELT(dad, i)), INTEGER(child), REAL(contrast), REAL(VECTOR_ELT(P, i)), nrx, ncx, nrs, REAL(TMP));
+        SET_VECTOR_ELT(RESULT, i, TMP);
+        UNPROTECT(1); // TMP
+        }
+    UNPROTECT(1); //RESULT
+    return(RESULT);
+}
+*/
+
+void helpPrep2(double *dad, int *child, double *contrast, double *evi, int nr, int nc, int nrs, double *res){
+    int i, j;
+    F77_CALL(dgemm)("N", "N", &nr, &nc, &nc, &one, dad, &nr, evi, &nc, &zero, res, &nr FCONE FCONE);
+    for(i = 0; i < nr; i++){
+        for(j = 0; j < nc; j++) res[i + j*nr] *= contrast[child[i] - 1L + j*nrs];
+    }
+}
+
+/*
+SEXP getPrep2(SEXP dad, SEXP child, SEXP contrast, SEXP evi, SEXP nr, SEXP nc, SEXP nco){
+    R_len_t i, n=length(dad);
+    int ncx=INTEGER(nc)[0], nrx=INTEGER(nr)[0], ncs=INTEGER(nco)[0];
+    SEXP TMP, RESULT;
+    PROTECT(RESULT = allocVector(VECSXP, n));
+    for(i=0; i<n; i++){
+        PROTECT(TMP = allocMatrix(REALSXP, nrx, ncx));
+        helpPrep2(REAL(VECTOR_ELT(dad, i)), INTEGER(child), REAL(contrast),  REAL(evi), nrx, ncx, ncs, REAL(TMP));
+        SET_VECTOR_ELT(RESULT, i, TMP);
+        UNPROTECT(1);
+        }
+    UNPROTECT(1);
+    return(RESULT);
+}
+*/
+
+// child *= (dad * P)
+void goDown(double *dad, double *child, double *P, int nr, int nc, double *res){
+    if(nc == 4){
+        kernel4(dad, P, nr, child, NULL, KERNEL4_MULT);
+        return;
+    }
+    F77_CALL(dgemm)("N", "N", &nr, &nc, &nc, &one, dad, &nr, P, &nc, &zero, res, &nr FCONE FCONE);
+    for(int j=0; j<(nc * nr); j++) child[j]*=res[j];
+}
+
+// dad *= (child * P), T lookup table of the tip
+void goUp(double *dad, int *child, double *T, int nr, int nc, int nco){
+    tipMult(child, T, nr, nr, nc, nco, dad);
+}
+
+// , double *w
+// key is the node below the edge, used for the transition matrix cache
+void updateLLQ(ll_ctx *ctx, SEXP dlist, int pa, int ch, int key,
+               double el, double *g, int nr,
+               int nc, int ntips, int nco, int k,
+               double *tmp){
+    int i;
+    double *LL = ctx->LL, *P;
+    if(ch>ntips){
+        for(i = 0; i < k; i++){
+            P = getPctx(ctx, key, i, el, g[i]);
+            goDown(&LL[LINDEX(ch, i)], &LL[LINDEX(pa, i)], P, nr, nc, tmp);
+        }
+    }
+    else{
+        for(i = 0; i < k; i++){
+            goUp(&LL[LINDEX(pa, i)], INTEGER(VECTOR_ELT(dlist, ch-1L)), getTctx(ctx, key, i, el, g[i]), nr, nc, nco);
+        }
+    }
+}
+
+
+// double *w,
+void updateLL2(ll_ctx *ctx, SEXP dlist, int pa, int ch,
+    double el,  double *g, int nr,
+    int nc, int ntips, int nco, int k,
+    double *tmp){
+    int i;
+    double *LL = ctx->LL, *P;
+
+    if(ch>ntips){
+        for(i = 0; i < k; i++){
+            P = getPctx(ctx, ch, i, el, g[i]);
+            goDown(&LL[LINDEX(pa, i)], &LL[LINDEX(ch, i)], P, nr, nc, tmp);
+         }
+    }
+    else{
+        for(i = 0; i < k; i++){
+            goUp(&LL[LINDEX(pa, i)], INTEGER(VECTOR_ELT(dlist, ch-1L)), getTctx(ctx, ch, i, el, g[i]), nr, nc, nco);
+        }
+    }
+}
+
+
+void ExtractScale(int *SCM, int ch, int k, int *nr, int *ntips, double *res){
+    int i;
+    int j, blub, tmp;
+    for(i = 0; i < k; i++){
+        blub = LINDEX3(ch, i);
+        for(j=0; j< *nr; j++) res[j +i * *nr] = SCM[blub+j];
+    }
+    for(i = 0; i< *nr; i++){
+        tmp = res[i];
+        for(j = 1; j<k; j++){
+            if(res[i+j * *nr]<tmp)tmp = res[i+j * *nr];
+        }
+        for(j=0; j<k; j++) res[i+j * *nr] = pow(ScaleEPS, (res[i+j * *nr] - tmp));
+    }
+}
+
+
+// in getDad
+// dad / child * P
+void helpDAD(double *dad, double *child, double *P, int nr, int nc, double *res){
+    F77_CALL(dgemm)("N", "N", &nr, &nc, &nc, &one, child, &nr, P, &nc, &zero, res, &nr FCONE FCONE);
+    for(int j=0; j<(nc * nr); j++) res[j]=dad[j]/res[j];
+}
+
+//
+SEXP getDAD(SEXP dad, SEXP child, SEXP P, SEXP nr, SEXP nc){
+    R_len_t i, n=length(P);
+    int ncx=INTEGER(nc)[0], nrx=INTEGER(nr)[0]; //, j
+    SEXP TMP, RESULT;
+    PROTECT(RESULT = allocVector(VECSXP, n));
+    for(i=0; i<n; i++){
+        PROTECT(TMP = allocMatrix(REALSXP, nrx, ncx));
+        helpDAD(REAL(VECTOR_ELT(dad, i)), REAL(VECTOR_ELT(child, i)), REAL(VECTOR_ELT(P, i)), nrx, ncx, REAL(TMP));
+        SET_VECTOR_ELT(RESULT, i, TMP);
+        UNPROTECT(1); // TMP
+        }
+    UNPROTECT(1); //RESULT
+    return(RESULT);
+    }
+
+
+SEXP getPrep(SEXP dad, SEXP child, SEXP eve, SEXP evi, SEXP nr, SEXP nc){
+    R_len_t i, n=length(dad);
+    int ncx=INTEGER(nc)[0], nrx=INTEGER(nr)[0]; //, j
+    double *tmp;
+    SEXP TMP, RESULT;
+    tmp = (double *) R_alloc(nrx*ncx, sizeof(double));
+    PROTECT(RESULT = allocVector(VECSXP, n));
+    for(i=0; i<n; i++){
+        PROTECT(TMP = allocMatrix(REALSXP, nrx, ncx));
+        helpPrep(REAL(VECTOR_ELT(dad, i)), REAL(VECTOR_ELT(child, i)), REAL(eve),  REAL(evi), nrx, ncx, tmp, REAL(TMP));
+        SET_VECTOR_ELT(RESULT, i, TMP);
+        UNPROTECT(1); // TMP
+        }
+    UNPROTECT(1); //RESULT
+    return(RESULT);
+}
+
+
+// X is the sumtable of an edge, i.e. the product of the two adjacent partials
+// in eigen space, a nr x (nc * ld) matrix. A single dgemm gives the site
+// likelihoods f and their first and second derivative with respect to the
+// edge length, which follow f directly in memory (f, df, d2f).
+static void NR_fdf(double *lambda, int nc, double el, double *w, double *X, int ld, int nr,
+                   double *f0, double *coef, double *f){
+    int i, h, m = ld * nc, three = 3;
+    double a;
+    for(i=0; i<ld; i++){
+        for(h=0; h<nc; h++){
+            a = w[i] * exp(lambda[i*nc + h] * el);
+            coef[i*nc + h] = a;
+            coef[m + i*nc + h] = a * lambda[i*nc + h];
+            coef[2*m + i*nc + h] = a * lambda[i*nc + h] * lambda[i*nc + h];
+        }
+    }
+    F77_CALL(dgemm)("N", "N", &nr, &three, &m, &one, X, &nr, coef, &m, &zero, f, &nr FCONE FCONE);
+    for(i=0; i<nr; i++) f[i] += f0[i];
+}
+
+
+// derivatives of the log-likelihood of the edge and, if lik, the
+// log-likelihood itself. info is the outer product approximation of the
+// information used as fallback and for the variance. With mkv the first nc
+// patterns are the constant ones (ASC), they are assumed to be unscaled.
+static double NR_ll(double *f, double *df, double *d2f, double *weight, int nr, int nc,
+                    int mkv, int lik, double *dl, double *d2l, double *info){
+    int j;
+    double l=0.0, a=0.0, b=0.0, c=0.0, y, z, sw=0.0;
+    double p0=0.0, p1=0.0, p2=0.0, q;
+    for(j=0; j<nr; j++){
+        z = 1.0 / f[j];
+        y = df[j] * z;
+        a += weight[j] * y;
+        b += weight[j] * (d2f[j] * z - y * y);
+        c += weight[j] * y * y;
+        sw += weight[j];
+    }
+    if(lik){
+        for(j=0; j<nr; j++) l += weight[j] * log(f[j]);
+    }
+    if(mkv){
+        for(j=0; j < nc && j < nr; j++){
+            p0 += f[j];
+            p1 += df[j];
+            p2 += d2f[j];
+        }
+        if(p0 >= 1.0) return R_NegInf;
+        q = 1.0 - p0;
+        if(lik) l -= sw * log(q);
+        a += sw * p1 / q;
+        b += sw * (p2 / q + (p1 * p1) / (q * q));
+    }
+    *dl = a;
+    *d2l = b;
+    *info = c;
+    return l;
+}
+
+
 // in ancestral.pml and rnodes
 SEXP LogLik2(SEXP dlist, SEXP P, SEXP nr, SEXP nc, SEXP node, SEXP edge, SEXP nTips, SEXP mNodes, SEXP contrast, SEXP nco){
     R_len_t i, n = length(node);
@@ -563,304 +2353,2667 @@ SEXP LogLik2(SEXP dlist, SEXP P, SEXP nr, SEXP nc, SEXP node, SEXP edge, SEXP nT
                F77_CALL(dgemm)("N", "N", &nrx, &ncx, &ncx, &one, REAL(VECTOR_ELT(ans, ei-nt)), &nrx,
                    REAL(VECTOR_ELT(P, i)), &ncx, &zero, res, &nrx FCONE FCONE);
             }
-        else {
-            if(ei < nt)
-                matp(INTEGER(VECTOR_ELT(dlist, ei)), REAL(contrast), REAL(VECTOR_ELT(P, i)), INTEGER(nr), INTEGER(nc), INTEGER(nco), rtmp);
-            else
-                F77_CALL(dgemm)("N", "N", &nrx, &ncx, &ncx, &one, REAL(VECTOR_ELT(ans, ei-nt)), &nrx,
-                    REAL(VECTOR_ELT(P, i)), &ncx, &zero, rtmp, &nrx FCONE FCONE);
-            for(j=0; j < (nrx*ncx); j++) res[j] *= rtmp[j];
+        else {
+            if(ei < nt)
+                matp(INTEGER(VECTOR_ELT(dlist, ei)), REAL(contrast), REAL(VECTOR_ELT(P, i)), INTEGER(nr), INTEGER(nc), INTEGER(nco), rtmp);
+            else
+                F77_CALL(dgemm)("N", "N", &nrx, &ncx, &ncx, &one, REAL(VECTOR_ELT(ans, ei-nt)), &nrx,
+                    REAL(VECTOR_ELT(P, i)), &ncx, &zero, rtmp, &nrx FCONE FCONE);
+            for(j=0; j < (nrx*ncx); j++) res[j] *= rtmp[j];
+        }
+    }
+    SET_VECTOR_ELT(ans, ni, result);
+    UNPROTECT(2); // result ans
+    return(ans);
+}
+
+
+SEXP getM3(SEXP dad, SEXP child, SEXP P, SEXP nr, SEXP nc){
+    R_len_t i, n=length(P);
+    int ncx=INTEGER(nc)[0], nrx=INTEGER(nr)[0], j;
+    SEXP TMP, RESULT;
+    double *tmp, *daddy;
+    PROTECT(RESULT = allocVector(VECSXP, n));
+    for(i=0; i<n; i++){
+        PROTECT(TMP = allocMatrix(REALSXP, nrx, ncx));
+        tmp = REAL(TMP);
+//        matprod(REAL(VECTOR_ELT(child, i)), nrx, ncx, REAL(VECTOR_ELT(P, i)), ncx, ncx, tmp);
+        F77_CALL(dgemm)("N", "N", &nrx, &ncx, &ncx, &one, REAL(VECTOR_ELT(child, i)), &nrx, REAL(VECTOR_ELT(P, i)), &ncx, &zero, tmp, &nrx FCONE FCONE);
+        daddy = REAL(VECTOR_ELT(dad, i));
+        for(j=0; j<(ncx * nrx); j++) tmp[j]*=daddy[j];
+        SET_VECTOR_ELT(RESULT, i, TMP);
+        UNPROTECT(1); // TMP
+        }
+    UNPROTECT(1); //RESULT
+    return(RESULT);
+    }
+
+
+
+// Newton-Raphson for the edge length, res: edge length, variance, log-likelihood.
+// Steps are taken in log(el) and use only the derivatives, the sign of the
+// first derivative brackets the optimum between lo and hi.
+// work needs FS3_WORK(nc, ld, nr) doubles, fs3w does not allocate and can be
+// used from threads.
+#define FS3_WORK(nc, ld, nr) (4L * (ld) * (nc) + 3L * (nr))
+
+static void fs3w(double *eva, int nc, double el, double *w, double *g, double *X, int ld, int nr,
+                 double *weight, double *f0, double tau, int mkv, double *work, double *res)
+{
+    double *lambda, *coef, *f, *df, *d2f, edle, s, snew, lo, hi, smin, smax;
+    double l0, dl=0.0, d2l=0.0, info=0.0, gs, hs, delta;
+    int i, h, k, cur=0, shrink=0;
+    lambda = work;
+    coef = lambda + ld * nc;
+    f = coef + 3L * ld * nc;
+    df = f + nr;
+    d2f = df + nr;
+    for(i=0; i<ld; i++){
+        for(h=0; h<nc; h++) lambda[i*nc + h] = eva[h] * g[i];
+    }
+    // some error handling avoid too big small edges
+    smin = log(tau); // 1e-8 phyML
+    smax = log(10.0);
+    lo = smin;
+    hi = smax;
+    s = log(el);
+    if(s < smin) s = smin;
+    if(s > smax) s = smax;
+
+    for(k=0; k<10; k++){
+        edle = exp(s);
+        NR_fdf(lambda, nc, edle, w, X, ld, nr, f0, coef, f);
+        l0 = NR_ll(f, df, d2f, weight, nr, nc, mkv, 0, &dl, &d2l, &info);
+        cur = 1;
+        gs = edle * dl;
+        hs = gs + edle * edle * d2l;
+        // Mkv needs longer edges
+        if(l0 == R_NegInf) gs = 1.0;
+        if(ISNAN(gs) || gs == 0.0) break;
+        if(gs > 0.0) lo = s;
+        else hi = s;
+        if((s <= smin && gs < 0.0) || (s >= smax && gs > 0.0)) break;
+        if(l0 == R_NegInf) delta = 1.0;
+        else if(d2l < 0.0 && gs > 0.0){
+            // growing edges take the longer of the Newton steps for el and
+            // log(el), stop if it cannot gain more than the tolerance
+            if(-0.5 * dl * dl / d2l < 1e-7) break;
+            delta = log1p(-dl / (d2l * edle));
+            if(hs < 0.0 && -gs / hs > delta) delta = -gs / hs;
+            shrink = 0;
+        }
+        else if(hs < 0.0){
+            // shrinking edges a Newton step for log(el)
+            if(-0.5 * gs * gs / hs < 1e-7) break;
+            delta = -gs / hs;
+            // delta < -0.5 means the Newton step for el itself ends below
+            // zero, if this happens twice in a row try the lower bound
+            if(delta < -0.5 && shrink) delta = lo - s;
+            shrink = delta < -0.5;
+        }
+        else{
+            delta = (info > 0.0) ? dl / (edle * info) : gs;
+            if(delta > 3.0) delta = 3.0;
+            if(delta < -3.0) delta = -3.0;
+            shrink = 0;
+        }
+        snew = s + delta;
+        // stay inside the bracket
+        if(snew <= lo) snew = (lo > smin) ? 0.5 * (s + lo) : smin;
+        if(snew >= hi) snew = (hi < smax) ? 0.5 * (s + hi) : smax;
+        if(fabs(snew - s) < 1e-8) break;
+        s = snew;
+        cur = 0;
+    }
+    edle = exp(s);
+    if(!cur) NR_fdf(lambda, nc, edle, w, X, ld, nr, f0, coef, f);
+    l0 = NR_ll(f, df, d2f, weight, nr, nc, mkv, 1, &dl, &d2l, &info);
+    res[0] = edle;
+    res[1] = 1.0 / info;
+    res[2] = l0;
+}
+
+
+void fs3(double *eva, int nc, double el, double *w, double *g, double *X, int ld, int nr, double *weight,
+         double *f0, double tau, int mkv, double *res)
+{
+    double *work = (double *) R_alloc(FS3_WORK(nc, ld, nr), sizeof(double));
+    fs3w(eva, nc, el, w, g, X, ld, nr, weight, f0, tau, mkv, work, res);
+}
+
+
+// log-likelihood of an edge for the sumtable X at edge length el
+static double edgeLogLik(double *eva, int nc, double el, double *w, double *g, double *X, int ld, int nr,
+                         double *weight, double *f0, int mkv){
+    int i, h;
+    double dl, d2l, info;
+    double *lambda = (double *) R_alloc(ld * nc, sizeof(double));
+    double *coef = (double *) R_alloc(3L * ld * nc, sizeof(double));
+    double *f = (double *) R_alloc(3L * nr, sizeof(double));
+    for(i=0; i<ld; i++){
+        for(h=0; h<nc; h++) lambda[i*nc + h] = eva[h] * g[i];
+    }
+    NR_fdf(lambda, nc, el, w, X, ld, nr, f0, coef, f);
+    return NR_ll(f, f + nr, f + 2*nr, weight, nr, nc, mkv, 1, &dl, &d2l, &info);
+}
+
+
+// in fs()
+SEXP FS4(SEXP eig, SEXP nc, SEXP el, SEXP w, SEXP g, SEXP X, SEXP dad, SEXP child, SEXP ld, SEXP nr,
+         SEXP weight, SEXP f0, SEXP tau, SEXP retA, SEXP retB)
+{
+    SEXP RESULT, EL, P;
+    double *tmp, *wgt=REAL(weight), edle, *eva=REAL(VECTOR_ELT(eig,0));
+    int ncx=INTEGER(nc)[0], nrx=INTEGER(nr)[0];
+    tmp = (double *) R_alloc(3L, sizeof(double));
+    PROTECT(RESULT = allocVector(VECSXP, 4));
+    edle = REAL(el)[0];
+    fs3(eva, ncx, edle, REAL(w), REAL(g), REAL(X), INTEGER(ld)[0], nrx, wgt, REAL(f0), REAL(tau)[0], 0, tmp);
+    PROTECT(EL = ScalarReal(tmp[0]));
+    PROTECT(P = getPM(eig, nc, EL, g));
+    SET_VECTOR_ELT(RESULT, 0, EL);
+    if(INTEGER(retA)[0]>0L)SET_VECTOR_ELT(RESULT, 1, getM3(child, dad, P, nr, nc));
+    if(INTEGER(retB)[0]>0L)SET_VECTOR_ELT(RESULT, 2, getM3(dad, child, P, nr, nc));
+// add variance ??
+    SET_VECTOR_ELT(RESULT, 3, ScalarReal(tmp[2]));
+    UNPROTECT(3);
+    return (RESULT);
+}
+
+// in dist.ml
+SEXP FS5(SEXP eig, SEXP nc, SEXP el, SEXP w, SEXP g, SEXP X, SEXP ld, SEXP nr, SEXP weight, SEXP f0, SEXP tau)
+{
+    SEXP RESULT; // EL, P;
+    double *wgt=REAL(weight), *eva=REAL(VECTOR_ELT(eig,0));
+    int ncx=INTEGER(nc)[0], nrx=INTEGER(nr)[0];
+    PROTECT(RESULT = allocVector(REALSXP, 3));
+    double edle = REAL(el)[0];
+    fs3(eva, ncx, edle, REAL(w), REAL(g), REAL(X), INTEGER(ld)[0], nrx, wgt, REAL(f0), REAL(tau)[0], 0, REAL(RESULT));
+    UNPROTECT(1);
+    return (RESULT);
+}
+
+
+// Smoothing of all edge lengths, the edges are visited in preorder and each
+// sweep starts where the last ended. The log-likelihood of a sweep is the one
+// of its last edge, sweeps stop after MAXIT or if the relative improvement is
+// below EPS. Returns list(edge lengths, log-likelihood, c(eps, sweeps)).
+SEXP optE(SEXP PARENT, SEXP CHILD, SEXP ANC, SEXP eig, SEXP EVI, SEXP EL,
+                  SEXP W, SEXP G, SEXP NR, SEXP NC, SEXP NTIPS, SEXP CONTRAST,
+                  SEXP CONTRAST2, SEXP NCO,
+                  SEXP dlist, SEXP WEIGHT, SEXP F0, SEXP TAU, SEXP ASC,
+                  SEXP MAXIT, SEXP EPS, SEXP CTX){
+    int i, k=length(W), h, j, n=length(PARENT), m, lEL=length(EL), mkv=asLogical(ASC);
+    int nc=INTEGER(NC)[0], nr=INTEGER(NR)[0], ntips=INTEGER(NTIPS)[0];
+    int iter, maxit=asInteger(MAXIT);
+    ll_ctx *ctx = getLLCtxNode(CTX, nr, ntips, nc, k);
+    double *LL = ctx->LL;
+    int *parent=INTEGER(PARENT), *child=INTEGER(CHILD), *anc=INTEGER(ANC);
+    int loli, nco =INTEGER(NCO)[0];
+    double *weight=REAL(WEIGHT), *f0=REAL(F0), *w=REAL(W), tau=REAL(TAU)[0];
+    double *g=REAL(G), *evi=REAL(EVI), *contrast=REAL(CONTRAST), *contrast2=REAL(CONTRAST2);
+    double *el, *elold; //=REAL(EL);
+    double *eva, *eve, *evei, *tmp, *P;
+    double  *X; // define it *blub=REAL(BLUB),
+    double *blub = (double *) R_alloc(nr * k, sizeof(double));
+    double oldel; //=el[ch-1L]
+    double ll=0.0, oldll=0.0, lsc=0.0, eps=1.0, epsilon=asReal(EPS);
+    int ancloli, pa, ch, sc; //=anc[loli]
+    double *res = (double *) R_alloc(3L, sizeof(double)), *llsweep;
+    tmp = (double *) R_alloc(nr * nc, sizeof(double));
+    X = (double *) R_alloc(k * nr * nc, sizeof(double));
+    elold = (double *) R_alloc(lEL, sizeof(double));
+    // log-likelihood before the first and after each accepted sweep
+    llsweep = (double *) R_alloc(maxit + 1L, sizeof(double));
+
+    ExtractScale(ctx->SCM, parent[0], k, &nr, &ntips, blub);
+    // the scaling of the root is the same for all edges and sweeps
+    for(j = 0; j < nr; j++){
+        sc = ctx->SCM[(parent[0] - ntips - 1L) * nr + j];
+        for(i = 1; i < k; i++){
+            if(ctx->SCM[(parent[0] - ntips - 1L) * nr + i * ntips * nr + j] < sc)
+                sc = ctx->SCM[(parent[0] - ntips - 1L) * nr + i * ntips * nr + j];
+        }
+        lsc += weight[j] * sc * log(ScaleEPS);
+    }
+
+    SEXP RESULT, ELR, LLS;
+    PROTECT(RESULT = allocVector(VECSXP, 4));
+    PROTECT(ELR = allocVector(REALSXP, lEL));
+    el=REAL(ELR);
+    for(i = 0; i < lEL; i++) el[i] = REAL(EL)[i];
+    eva = REAL(VECTOR_ELT(eig, 0));
+    eve = REAL(VECTOR_ELT(eig, 1));
+    evei = REAL(VECTOR_ELT(eig, 2));
+    ll_ctx_eig(ctx, eva, eve, evei);
+    ll_ctx_contrast(ctx, contrast, nco);
+    // moving the root changes all vectors
+    ll_ctx_dirty(ctx, -1L);
+
+    loli = parent[0];
+    for(iter = 0; iter < maxit && eps > epsilon; iter++){
+        for(i = 0; i < lEL; i++) elold[i] = el[i];
+        for(m = 0; m < n; m++){
+            pa = parent[m];
+            ch = child[m];
+            oldel=el[ch-1L];
+
+            while(loli != pa){
+                ancloli=anc[loli];
+                for(i = 0; i < k; i++){
+                    P = getPctx(ctx, loli, i, el[loli-1L], g[i]);
+                    moveLL5(&LL[LINDEX(loli, i)], &LL[LINDEX(ancloli, i)], P, &nr, &nc, tmp);
+                }
+                loli = ancloli;
+            }
+            // moveDad
+            if(ch>ntips){
+                for(i = 0; i < k; i++){
+                    P = getPctx(ctx, ch, i, oldel, g[i]);
+                    helpDADI(&LL[LINDEX(pa, i)], &LL[LINDEX(ch, i)], P, nr, nc, tmp);
+                    helpPrep(&LL[LINDEX(pa, i)], &LL[LINDEX(ch, i)], eve, evi, nr, nc, tmp, &X[i*nr*nc]);
+                    for(h = 0; h < nc; h++){
+                        for(j = 0; j < nr; j++){
+                            X[j+h*nr + i*nr*nc] *= blub[j+i*nr];
+                        }
+                    }
+                }
+            }
+            else{
+                for(i = 0; i < k; i++){
+                    helpDAD5(&LL[LINDEX(pa, i)], INTEGER(VECTOR_ELT(dlist, ch-1L)), getTctx(ctx, ch, i, oldel, g[i]), nr, nc, nco);
+                    helpPrep2(&LL[LINDEX(pa, i)], INTEGER(VECTOR_ELT(dlist, ch-1L)), contrast2, evi, nr, nc, nco, &X[i*nr*nc]); //;
+                    for(h = 0; h < nc; h++){
+                        for(j = 0; j < nr; j++){
+                            X[j+h*nr + i*nr*nc] *= blub[j+i*nr];
+                        }
+                    }
+                }
+            }
+            if(iter == 0 && m == 0){
+                oldll = edgeLogLik(eva, nc, oldel, w, g, X, k, nr, weight, f0, mkv) + lsc;
+                llsweep[0] = oldll;
+            }
+            fs3(eva, nc, oldel, w, g, X, k, nr, weight, f0, tau, mkv, res);
+            updateLL2(ctx, dlist, pa, ch, res[0], g, nr,
+                nc, ntips, nco, k, tmp);
+            el[ch-1L] = res[0];
+            if (ch > ntips) loli  = ch;
+            else loli = pa;
+        }
+        ll = res[2] + lsc;
+        eps = (oldll - ll) / ll;
+        // keep the edges of the last sweep if it got worse
+        if(eps < 0){
+            for(i = 0; i < lEL; i++) el[i] = elold[i];
+            ll = oldll;
+            iter++;
+            break;
+        }
+        oldll = ll;
+        llsweep[iter + 1L] = ll;
+    }
+    SET_VECTOR_ELT(RESULT, 0, ELR);
+    SET_VECTOR_ELT(RESULT, 1, ScalarReal(ll));
+    SEXP CONV;
+    PROTECT(CONV = allocVector(REALSXP, 2));
+    REAL(CONV)[0] = eps;
+    REAL(CONV)[1] = (double) iter;
+    SET_VECTOR_ELT(RESULT, 2, CONV);
+    // a rejected last sweep is counted in iter but has no log-likelihood
+    j = (eps < 0) ? iter : iter + 1L;
+    if(n == 0L || maxit < 1L) j = 0L;
+    PROTECT(LLS = allocVector(REALSXP, j));
+    for(i = 0; i < j; i++) REAL(LLS)[i] = llsweep[i];
+    SET_VECTOR_ELT(RESULT, 3, LLS);
+    UNPROTECT(4); // RESULT ELR CONV LLS
+    return(RESULT);
+}
+
+
+SEXP optQrtt(SEXP PARENT, SEXP CHILD, SEXP eig, SEXP EVI, SEXP EL,
+          SEXP W, SEXP G, SEXP NR, SEXP NC, SEXP NTIPS, SEXP CONTRAST,
+          SEXP CONTRAST2, SEXP NCO,
+          SEXP dlist, SEXP WEIGHT, SEXP F0, SEXP TAU, SEXP ASC, SEXP CTX){
+    int i, k=length(W), h, j, m, lEL=length(EL), mkv=asLogical(ASC);
+    int nc=INTEGER(NC)[0], nr=INTEGER(NR)[0], ntips=INTEGER(NTIPS)[0];
+    ll_ctx *ctx = getLLCtxNode(CTX, nr, ntips, nc, k);
+    double *LL = ctx->LL;
+    int *parent=INTEGER(PARENT), *child=INTEGER(CHILD), pa, ch;
+    int nco =INTEGER(NCO)[0]; // loli,
+    double *weight=REAL(WEIGHT), *f0=REAL(F0), *w=REAL(W), tau=REAL(TAU)[0];
+    double *g=REAL(G), *evi=REAL(EVI), *contrast=REAL(CONTRAST), *contrast2=REAL(CONTRAST2);
+    double *el, *X;
+    double *eva, *eve, *evei, *tmp, *P;
+    double *blub = (double *) R_alloc(nr * k, sizeof(double));
+    double oldel;
+    double *res = (double *) R_alloc(3L, sizeof(double));
+    tmp = (double *) R_alloc(nr * nc, sizeof(double));
+    X = (double *) R_alloc(k * nr * nc, sizeof(double));
+
+    ExtractScale(ctx->SCM, parent[0], k, &nr, &ntips, blub);
+
+    SEXP RESULT;
+    PROTECT(RESULT = allocVector(REALSXP, lEL));
+    el=REAL(RESULT);
+    for(i = 0; i < lEL; i++) el[i] = REAL(EL)[i];
+    eva = REAL(VECTOR_ELT(eig, 0));
+    eve = REAL(VECTOR_ELT(eig, 1));
+    evei = REAL(VECTOR_ELT(eig, 2));
+    ll_ctx_eig(ctx, eva, eve, evei);
+    ll_ctx_contrast(ctx, contrast, nco);
+    // the vectors of the quartet get changed
+    for(m = 0; m < 5L; m++){
+        ll_ctx_dirty(ctx, parent[m]);
+        ll_ctx_dirty(ctx, child[m]);
+    }
+
+    for(m = 4L; m > -1L; m--){
+        pa = parent[m];
+        ch = child[m];
+        oldel=el[m];
+        // moveDad
+        if(ch>ntips){
+            for(i = 0; i < k; i++){
+                P = getPctx(ctx, ch, i, oldel, g[i]);
+                helpDADI(&LL[LINDEX(pa, i)], &LL[LINDEX(ch, i)], P, nr, nc, tmp);
+                helpPrep(&LL[LINDEX(pa, i)], &LL[LINDEX(ch, i)], eve, evi, nr, nc, tmp, &X[i*nr*nc]);
+                for(h = 0; h < nc; h++){
+                    for(j = 0; j < nr; j++){
+                        X[j+h*nr + i*nr*nc] *= blub[j+i*nr];
+                    }
+                }
+            }
+        }
+        else{
+            for(i = 0; i < k; i++){
+                helpDAD5(&LL[LINDEX(pa, i)], INTEGER(VECTOR_ELT(dlist, ch-1L)), getTctx(ctx, ch, i, oldel, g[i]), nr, nc, nco);
+                helpPrep2(&LL[LINDEX(pa, i)], INTEGER(VECTOR_ELT(dlist, ch-1L)), contrast2, evi, nr, nc, nco, &X[i*nr*nc]); //;
+                for(h = 0; h < nc; h++){
+                    for(j = 0; j < nr; j++){
+                        X[j+h*nr + i*nr*nc] *= blub[j+i*nr];
+                    }
+                }
+            }
+        }
+        fs3(eva, nc, oldel, w, g, X, k, nr, weight, f0, tau, mkv, res);
+// go up
+// if i=2 go down
+        if(m==2)updateLLQ(ctx, dlist, ch, pa, ch, res[0], g, nr,
+                  nc, ntips, nco, k, tmp);
+        else updateLLQ(ctx, dlist, pa, ch, ch, res[0], g, nr,
+                  nc, ntips, nco, k, tmp);
+        el[m] = res[0];
+    }
+    UNPROTECT(1); //RESULT
+    return(RESULT);
+}
+
+
+// V %*% P for one rate category, V and res are nr x nc matrices
+static void vecP(const double *V, const double *P, int nr, int nc, double *res){
+    if(nc == 4) kernel4(V, P, nr, res, NULL, KERNEL4_SET);
+    else F77_CALL(dgemm)("N", "N", &nr, &nc, &nc, &one, V, &nr, P, &nc, &zero, res, &nr FCONE FCONE);
+}
+
+
+// pointers to the tip data of dlist, so threads need not touch R objects
+static int **tipData(SEXP dlist, int ntips){
+    int i, **X = (int **) R_alloc(ntips, sizeof(int *));
+    for(i = 0; i < ntips; i++) X[i] = INTEGER(VECTOR_ELT(dlist, i));
+    return X;
+}
+
+
+// children of node v are kids[start[v]], ..., kids[start[v + 1] - 1], nodes
+// are 1, ..., nn
+static void nodeChildren(int *parent, int *child, int n, int nn, int *start, int *kids){
+    int m, v, *cnt = (int *) R_alloc(nn + 1L, sizeof(int));
+    for(v = 0; v <= nn; v++) cnt[v] = 0L;
+    for(m = 0; m < n; m++) cnt[parent[m]]++;
+    start[0] = 0L;
+    for(v = 0; v <= nn; v++) start[v + 1L] = start[v] + cnt[v];
+    for(v = 0; v <= nn; v++) cnt[v] = 0L;
+    for(m = 0; m < n; m++) kids[start[parent[m]] + cnt[parent[m]]++] = child[m];
+}
+
+
+// U is the partial at p without the subtree of its child v for rate
+// category i, sc its scaling counts. UP[p] has to be known if p is not the
+// root. X are the tip data, tmp needs nr * nc doubles.
+static void outsideNode(ll_ctx *ctx, int **X, int p, int v, int i, int root,
+                        int *start, int *kids, double *el, double *g, double *UP,
+                        int *USC, double *U, int *sc, double *tmp){
+    int j, s, nr = ctx->nr, nc = ctx->nc, nco = ctx->nco, ntips = ctx->ntips;
+    double *LL = ctx->LL;
+
+    if(p != root){
+        vecP(&UP[LINDEX(p, i)], getPctx(ctx, p, i, el[p - 1L], g[i]), nr, nc, U);
+        memcpy(sc, &USC[(p - ntips - 1L) * nr + i * ntips * nr], nr * sizeof(int));
+    }
+    else{
+        for(j = 0; j < nr * nc; j++) U[j] = 1.0;
+        for(j = 0; j < nr; j++) sc[j] = 0L;
+    }
+    for(s = start[p]; s < start[p + 1L]; s++){
+        if(kids[s] == v) continue;
+        if(kids[s] > ntips){
+            vecP(&LL[LINDEX(kids[s], i)], getPctx(ctx, kids[s], i, el[kids[s] - 1L], g[i]), nr, nc, tmp);
+            for(j = 0; j < nr * nc; j++) U[j] *= tmp[j];
+            for(j = 0; j < nr; j++) sc[j] += ctx->SCM[(kids[s] - ntips - 1L) * nr + i * ntips * nr + j];
+        }
+        else tipMult(X[kids[s] - 1L], getTctx(ctx, kids[s], i, el[kids[s] - 1L], g[i]),
+                     nr, nr, nc, nco, U);
+    }
+    scaleBlock(U, nr, nr, nc, sc);
+}
+
+
+// Partials for the outside of the subtrees, a preorder pass after PML4.
+// For an internal node v below the root with parent p, UP[v] is the product
+// of the messages p gets from all its other neighbours, i.e. a partial for
+// the states of p. USC are the scaling counts of UP (same layout as SCM).
+// parent and child are the edges in preorder, start and kids the children of
+// the nodes (see nodeChildren).
+static void outsideLL(ll_ctx *ctx, int **X, int *parent, int *child, int n,
+                      int *start, int *kids, double *el, double *g, int k, double *UP,
+                      int *USC, double *tmp){
+    int i, m, v, nr = ctx->nr, nc = ctx->nc, ntips = ctx->ntips, root = parent[0];
+
+    for(m = 0; m < n; m++){
+        v = child[m];
+        if(v <= ntips) continue;
+        for(i = 0; i < k; i++){
+            outsideNode(ctx, X, parent[m], v, i, root, start, kids, el, g, UP, USC,
+                        &UP[LINDEX(v, i)], &USC[(v - ntips - 1L) * nr + i * ntips * nr], tmp);
+        }
+    }
+}
+
+
+// leaf of a quartet in optNNI: partials V with rate stride vs (0 for tips)
+// and their scaling counts S with rate stride ss (NULL for tips)
+typedef struct qleaf {
+    double *V;
+    int *S;
+    size_t vs, ss;
+} qleaf;
+
+// doubles of work space needed by optQuartet
+#define QRTT_WORK(nr, nc, k) (7L * (k) * (nr) * (nc) + 2L * (nr) * (nc) + (k) * (nr) + \
+    2L * (k) * (nc) * (nc) + (nc) + FS3_WORK(nc, k, nr))
+
+
+// The scaling counts of a tree made of the leaves L are the sums of theirs.
+// blub gets the scaling of the rate categories relative to the smallest
+// count of a site, the log-likelihood of the smallest counts is returned.
+static double leafScale(qleaf *L, int nl, int k, int nr, double *weight, double *blub){
+    int i, j, l, c, cmin = 0;
+    double lsc = 0.0;
+    for(j = 0; j < nr; j++){
+        for(i = 0; i < k; i++){
+            c = 0L;
+            for(l = 0; l < nl; l++) if(L[l].S != NULL) c += L[l].S[i * L[l].ss + j];
+            blub[j + i * nr] = c;
+            if(i == 0 || c < cmin) cmin = c;
+        }
+        for(i = 0; i < k; i++) blub[j + i * nr] = pow(ScaleEPS, blub[j + i * nr] - cmin);
+        lsc += weight[j] * cmin * LOG_SCALE_EPS;
+    }
+    return lsc;
+}
+
+
+// X *= blub, relative scaling of the rate categories
+static void scaleSumtable(double *X, double *blub, int k, int nr, int nc){
+    int i, h, j;
+    for(i = 0; i < k; i++){
+        for(h = 0; h < nc; h++){
+            for(j = 0; j < nr; j++) X[j + h*nr + i*nr*nc] *= blub[j + i*nr];
+        }
+    }
+}
+
+
+// Optimises the edges of the quartet ((1,2),(3,4)) with leaves L, el are the
+// edge lengths in the order 1, 2, inner edge, 3, 4. The sweeps over the 5
+// edges stop after maxit, if the relative improvement is below epsilon or if
+// the log-likelihood stays below llcomp. Returns the log-likelihood of the
+// whole tree. Does not allocate, work needs QRTT_WORK doubles.
+static double optQuartet(qleaf *L, double *el, double *eva, double *eve, double *evei,
+                         double *evi, double *w, double *g, int k, int nr, int nc,
+                         double *weight, double *f0, double tau, int mkv, int maxit,
+                         double epsilon, double llcomp, double *work){
+    int i, j, l, iter, rc = nr * nc, lind[4] = {0, 1, 3, 4};
+    size_t krc = (size_t) k * rc, nc2 = (size_t) nc * nc;
+    double *M = work, *x = M + 4L * krc, *y = x + krc, *X = y + krc, *u;
+    double *D = X + krc, *T = D + rc, *blub = T + rc, *P = blub + (size_t) k * nr;
+    double *P5 = P + k * nc2, *ptmp = P5 + k * nc2, *fw = ptmp + nc;
+    double res[3], elold[5], ll = R_NegInf, oldll = R_NegInf, lsc = 0.0, eps;
+
+    lsc = leafScale(L, 4L, k, nr, weight, blub);
+    // messages from the leaves
+    for(l = 0; l < 4; l++){
+        for(i = 0; i < k; i++){
+            getPw(eva, eve, evei, nc, el[lind[l]], g[i], ptmp, P);
+            vecP(L[l].V + i * L[l].vs, P, nr, nc, &M[l * krc + i * rc]);
+        }
+    }
+    for(iter = 0; iter < maxit; iter++){
+        memcpy(elold, el, 5L * sizeof(double));
+        // inner edge
+        for(i = 0; i < k; i++){
+            for(j = 0; j < rc; j++){
+                x[i * rc + j] = M[i * rc + j] * M[krc + i * rc + j];
+                y[i * rc + j] = M[2L * krc + i * rc + j] * M[3L * krc + i * rc + j];
+            }
+            helpPrep(&x[i * rc], &y[i * rc], eve, evi, nr, nc, T, &X[i * rc]);
+        }
+        scaleSumtable(X, blub, k, nr, nc);
+        fs3w(eva, nc, el[2], w, g, X, k, nr, weight, f0, tau, mkv, fw, res);
+        el[2] = res[0];
+        for(i = 0; i < k; i++) getPw(eva, eve, evei, nc, el[2], g[i], ptmp, &P5[i * nc2]);
+        // pendant edges, the partner of leaf l is l ^ 1
+        for(l = 0; l < 4; l++){
+            u = l < 2 ? y : x;
+            for(i = 0; i < k; i++){
+                vecP(&u[i * rc], &P5[i * nc2], nr, nc, D);
+                for(j = 0; j < rc; j++) D[j] *= M[(l ^ 1) * krc + i * rc + j];
+                helpPrep(D, L[l].V + i * L[l].vs, eve, evi, nr, nc, T, &X[i * rc]);
+            }
+            scaleSumtable(X, blub, k, nr, nc);
+            fs3w(eva, nc, el[lind[l]], w, g, X, k, nr, weight, f0, tau, mkv, fw, res);
+            el[lind[l]] = res[0];
+            for(i = 0; i < k; i++){
+                getPw(eva, eve, evei, nc, el[lind[l]], g[i], ptmp, P);
+                vecP(L[l].V + i * L[l].vs, P, nr, nc, &M[l * krc + i * rc]);
+            }
+            if(l == 1){
+                for(j = 0; j < (int) krc; j++) x[j] = M[j] * M[krc + j];
+            }
+        }
+        ll = res[2] + lsc;
+        if(ll < oldll){
+            memcpy(el, elold, 5L * sizeof(double));
+            ll = oldll;
+            break;
+        }
+        eps = (oldll - ll) / ll;
+        oldll = ll;
+        if(eps < epsilon || ll < llcomp) break;
+    }
+    return ll;
+}
+
+
+// NNI moves for all internal edges, INDEX is the matrix (a, b, c, d, e, f)
+// of indexNNI3. For each edge the two alternative quartets get their 5 edges
+// optimised like in optQrtt, while the rest of the tree is kept fixed. The
+// candidates are independent of each other and are scored in parallel with
+// the threads of the context, the likelihood vectors are only read.
+// Needs a call of PML4 for the tree first, PARENT and CHILD are its edges in
+// preorder. Returns list(log-likelihoods, edge lengths) with two rows per
+// internal edge, edge lengths in the order of the quartets in pml.nni.
+SEXP optNNI(SEXP INDEX, SEXP PARENT, SEXP CHILD, SEXP eig, SEXP EVI, SEXP EL,
+            SEXP W, SEXP G, SEXP NR, SEXP NC, SEXP NTIPS, SEXP CONTRAST, SEXP NCO,
+            SEXP dlist, SEXP WEIGHT, SEXP F0, SEXP TAU, SEXP ASC, SEXP MAXIT,
+            SEXP EPS, SEXP LLCOMP, SEXP CTX){
+    int q, nthreads, k=length(W), mkv=asLogical(ASC), maxit=asInteger(MAXIT), *start, *kids;
+    int nc=INTEGER(NC)[0], nr=INTEGER(NR)[0], ntips=INTEGER(NTIPS)[0], nco=INTEGER(NCO)[0];
+    int n=length(PARENT), nq=length(INDEX) / 6L, *index=INTEGER(INDEX), root=INTEGER(PARENT)[0];
+    int **X, *USC;
+    ll_ctx *ctx = getLLCtxNode(CTX, nr, ntips, nc, k);
+    double *weight=REAL(WEIGHT), *f0=REAL(F0), *w=REAL(W), *g=REAL(G), *el=REAL(EL);
+    double *evi=REAL(EVI), *contrast=REAL(CONTRAST), tau=REAL(TAU)[0];
+    double epsilon=asReal(EPS), llcomp=asReal(LLCOMP);
+    double *eva, *eve, *evei, *UP, *scratch, *loglik, *elm;
+    size_t nwork, rc = (size_t) nr * nc;
+    SEXP RESULT, LOGLIK, ELM;
+
+    eva = REAL(VECTOR_ELT(eig, 0));
+    eve = REAL(VECTOR_ELT(eig, 1));
+    evei = REAL(VECTOR_ELT(eig, 2));
+    ll_ctx_eig(ctx, eva, eve, evei);
+    ll_ctx_contrast(ctx, contrast, nco);
+    kernel4_init();
+
+    UP = (double *) R_alloc(rc * k * ntips, sizeof(double));
+    USC = (int *) R_alloc((size_t) nr * k * ntips, sizeof(int));
+    start = (int *) R_alloc(2L * ntips + 2L, sizeof(int));
+    kids = (int *) R_alloc(n, sizeof(int));
+    nodeChildren(INTEGER(PARENT), INTEGER(CHILD), n, 2L * ntips, start, kids);
+    X = tipData(dlist, ntips);
+    outsideLL(ctx, X, INTEGER(PARENT), INTEGER(CHILD), n, start, kids, el, g, k, UP, USC,
+              (double *) R_alloc(rc, sizeof(double)));
+
+    PROTECT(RESULT = allocVector(VECSXP, 2));
+    PROTECT(LOGLIK = allocVector(REALSXP, 2L * nq));
+    PROTECT(ELM = allocMatrix(REALSXP, 2L * nq, 5));
+    loglik = REAL(LOGLIK);
+    elm = REAL(ELM);
+
+    nthreads = ctx->nthreads;
+    if(2L * nq < nthreads) nthreads = 2L * nq;
+    if(nthreads < 1L) nthreads = 1L;
+    // work space of optQuartet and up to 4 tips
+    nwork = QRTT_WORK(nr, nc, k) + 4L * rc;
+    scratch = (double *) R_alloc(nwork * nthreads, sizeof(double));
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1) if(nthreads > 1)
+#endif
+    for(q = 0; q < 2L * nq; q++){
+        int e = q / 2L, l, s, h, nd, leaf[4];
+        int a = index[e], b = index[e + nq], c = index[e + 2L * nq], d = index[e + 3L * nq];
+        int ei = index[e + 4L * nq], f = index[e + 5L * nq];
+        double *work = scratch, qel[5];
+        qleaf L[4];
+#ifdef _OPENMP
+        work += nwork * omp_get_thread_num();
+#endif
+        // the alternatives (a,d | b,c) and (d,b | a,c) of (a,b | d,c)
+        if(q % 2L == 0){
+            leaf[0] = a;
+            leaf[1] = d;
+            leaf[2] = b;
+        }
+        else{
+            leaf[0] = d;
+            leaf[1] = b;
+            leaf[2] = a;
+        }
+        leaf[3] = c;
+        qel[0] = el[leaf[0] - 1L];
+        qel[1] = el[leaf[1] - 1L];
+        qel[2] = el[ei - 1L];
+        qel[3] = el[leaf[2] - 1L];
+        qel[4] = (f == root) ? el[c - 1L] : el[f - 1L];
+        for(l = 0; l < 5; l++) if(qel[l] < 1e-8) qel[l] = 1e-8;
+        for(l = 0; l < 4; l++){
+            nd = leaf[l];
+            if(l == 3 && f != root){
+                // everything above f
+                L[l].V = &UP[LINDEX(f, 0)];
+                L[l].S = &USC[(f - ntips - 1L) * nr];
+                L[l].vs = (size_t) ntips * rc;
+                L[l].ss = (size_t) ntips * nr;
+            }
+            else if(nd > ntips){
+                L[l].V = &ctx->LL[LINDEX(nd, 0)];
+                L[l].S = &ctx->SCM[(nd - ntips - 1L) * nr];
+                L[l].vs = (size_t) ntips * rc;
+                L[l].ss = (size_t) ntips * nr;
+            }
+            else{
+                // tips as dense partials, the same for all rate categories
+                L[l].V = work + QRTT_WORK(nr, nc, k) + l * rc;
+                for(h = 0; h < nc; h++){
+                    for(s = 0; s < nr; s++) L[l].V[s + h * nr] = contrast[X[nd - 1L][s] - 1L + h * nco];
+                }
+                L[l].S = NULL;
+                L[l].vs = 0L;
+                L[l].ss = 0L;
+            }
+        }
+        loglik[q] = optQuartet(L, qel, eva, eve, evei, evi, w, g, k, nr, nc, weight, f0,
+                               tau, mkv, maxit, epsilon, llcomp, work);
+        for(l = 0; l < 5; l++) elm[q + l * 2L * nq] = qel[l];
+    }
+    SET_VECTOR_ELT(RESULT, 0, LOGLIK);
+    SET_VECTOR_ELT(RESULT, 1, ELM);
+    UNPROTECT(3); // RESULT LOGLIK ELM
+    return(RESULT);
+}
+
+
+// doubles of work space needed by optStar
+#define STAR_WORK(nr, nc, k) (4L * (k) * (nr) * (nc) + 2L * (nr) * (nc) + (k) * (nr) + \
+    (k) * (nc) * (nc) + (nc) + FS3_WORK(nc, k, nr))
+
+
+// Optimises the 3 edges of the star with leaves L, el are their lengths.
+// Each sweep starts with leaf 2, the sweeps stop after maxit or if the
+// relative improvement is below epsilon. Returns the log-likelihood of the
+// whole tree. Does not allocate, work needs STAR_WORK doubles.
+static double optStar(qleaf *L, double *el, double *eva, double *eve, double *evei,
+                      double *evi, double *w, double *g, int k, int nr, int nc,
+                      double *weight, double *f0, double tau, int mkv, int maxit,
+                      double epsilon, double *work){
+    int i, j, l, o, iter, rc = nr * nc;
+    size_t krc = (size_t) k * rc;
+    double *M = work, *X = M + 3L * krc, *D = X + krc, *T = D + rc, *blub = T + rc;
+    double *P = blub + (size_t) k * nr, *ptmp = P + (size_t) k * nc * nc, *fw = ptmp + nc;
+    double *M1, *M2, res[3], elold[3], ll = R_NegInf, oldll = R_NegInf, lsc, eps;
+
+    lsc = leafScale(L, 3L, k, nr, weight, blub);
+    for(l = 0; l < 3; l++){
+        for(i = 0; i < k; i++){
+            getPw(eva, eve, evei, nc, el[l], g[i], ptmp, P);
+            vecP(L[l].V + i * L[l].vs, P, nr, nc, &M[l * krc + i * rc]);
+        }
+    }
+    for(iter = 0; iter < maxit; iter++){
+        memcpy(elold, el, 3L * sizeof(double));
+        for(o = 0; o < 3; o++){
+            l = (o + 2) % 3;
+            M1 = &M[((l + 1) % 3) * krc];
+            M2 = &M[((l + 2) % 3) * krc];
+            for(i = 0; i < k; i++){
+                for(j = 0; j < rc; j++) D[j] = M1[i * rc + j] * M2[i * rc + j];
+                helpPrep(D, L[l].V + i * L[l].vs, eve, evi, nr, nc, T, &X[i * rc]);
+            }
+            scaleSumtable(X, blub, k, nr, nc);
+            fs3w(eva, nc, el[l], w, g, X, k, nr, weight, f0, tau, mkv, fw, res);
+            el[l] = res[0];
+            for(i = 0; i < k; i++){
+                getPw(eva, eve, evei, nc, el[l], g[i], ptmp, P);
+                vecP(L[l].V + i * L[l].vs, P, nr, nc, &M[l * krc + i * rc]);
+            }
+        }
+        ll = res[2] + lsc;
+        if(ll < oldll){
+            memcpy(el, elold, 3L * sizeof(double));
+            ll = oldll;
+            break;
+        }
+        eps = (oldll - ll) / ll;
+        oldll = ll;
+        if(eps < epsilon) break;
+    }
+    return ll;
+}
+
+
+// partials a traversal of optSPR keeps per level
+#define SPR_SLOTS 5L
+
+// The search of optSPR for one pruned subtree, one per thread. The tree and
+// its partials are only read, buf and sbuf hold SPR_SLOTS partials and their
+// scaling counts for each level of the traversal.
+typedef struct spr_ws {
+    int *start, *kids, *anc, *SCM, *USC, ntips, k, nr, nc, radius, mkv, maxit;
+    double *el, *LL, *TIPS, *UP, *eva, *eve, *evei, *evi, *w, *g, *weight, *f0;
+    double tau, epsilon;
+    // the pruned subtree and the best regraft position so far
+    qleaf S;
+    double els, best, bel[3];
+    int bv;
+    double *buf, *tmp, *P, *ptmp, *work;
+    int *sbuf;
+} spr_ws;
+
+
+static qleaf sprBuf(spr_ws *sp, int level, int slot){
+    size_t id = (size_t) level * SPR_SLOTS + slot, rc = (size_t) sp->nr * sp->nc;
+    qleaf L = {sp->buf + id * sp->k * rc, sp->sbuf + id * sp->k * sp->nr, rc, sp->nr};
+    return L;
+}
+
+
+// partial of the subtree below v
+static qleaf sprNode(spr_ws *sp, int v){
+    int nr = sp->nr, nc = sp->nc, ntips = sp->ntips;
+    qleaf L = {sp->TIPS + (size_t) (v - 1L) * nr * nc, NULL, 0L, 0L};
+    if(v > ntips){
+        L.V = &sp->LL[LINDEX(v, 0)];
+        L.S = &sp->SCM[(v - ntips - 1L) * nr];
+        L.vs = (size_t) ntips * nr * nc;
+        L.ss = (size_t) ntips * nr;
+    }
+    return L;
+}
+
+
+// partial of everything outside the subtree of v, at the parent of v
+static qleaf sprUp(spr_ws *sp, int v){
+    int nr = sp->nr, nc = sp->nc, ntips = sp->ntips;
+    qleaf L = {&sp->UP[LINDEX(v, 0)], &sp->USC[(v - ntips - 1L) * nr],
+               (size_t) ntips * nr * nc, (size_t) ntips * nr};
+    return L;
+}
+
+
+// res = A %*% P(el), or res *= A %*% P(el) if mult, with the scaling counts
+static void sprMsg(spr_ws *sp, qleaf *A, double el, qleaf *res, int mult){
+    int i, j, nr = sp->nr, nc = sp->nc, rc = nr * nc;
+    double *V;
+    int *S;
+    for(i = 0; i < sp->k; i++){
+        V = res->V + i * res->vs;
+        S = res->S + i * res->ss;
+        getPw(sp->eva, sp->eve, sp->evei, nc, el, sp->g[i], sp->ptmp, sp->P);
+        if(mult){
+            vecP(A->V + i * A->vs, sp->P, nr, nc, sp->tmp);
+            for(j = 0; j < rc; j++) V[j] *= sp->tmp[j];
+        }
+        else{
+            vecP(A->V + i * A->vs, sp->P, nr, nc, V);
+            for(j = 0; j < nr; j++) S[j] = 0L;
+        }
+        if(A->S != NULL) for(j = 0; j < nr; j++) S[j] += A->S[i * A->ss + j];
+    }
+}
+
+
+// res = A for a partial of a level
+static void sprCopy(spr_ws *sp, qleaf *A, qleaf *res){
+    memcpy(res->V, A->V, (size_t) sp->k * sp->nr * sp->nc * sizeof(double));
+    memcpy(res->S, A->S, (size_t) sp->k * sp->nr * sizeof(int));
+}
+
+
+static void sprScale(spr_ws *sp, qleaf *A){
+    int i;
+    for(i = 0; i < sp->k; i++) scaleBlock(A->V + i * A->vs, sp->nr, sp->nr, sp->nc, A->S + i * A->ss);
+}
+
+
+// regraft the pruned subtree on the edge of length len between the partials
+// A (upper end) and B (lower end, node v)
+static void sprTry(spr_ws *sp, qleaf *A, qleaf *B, int v, double len){
+    int l;
+    double el[3], ll;
+    qleaf L[3];
+    L[0] = *A;
+    L[1] = *B;
+    L[2] = sp->S;
+    el[0] = el[1] = len / 2.0;
+    el[2] = sp->els;
+    for(l = 0; l < 3; l++) if(el[l] < sp->tau) el[l] = sp->tau;
+    ll = optStar(L, el, sp->eva, sp->eve, sp->evei, sp->evi, sp->w, sp->g, sp->k,
+                 sp->nr, sp->nc, sp->weight, sp->f0, sp->tau, sp->mkv, sp->maxit,
+                 sp->epsilon, sp->work);
+    if(ll > sp->best){
+        sp->best = ll;
+        sp->bv = v;
+        memcpy(sp->bel, el, 3L * sizeof(double));
+    }
+}
+
+
+// Regraft positions in the subtree of v, A is the partial at the upper end
+// of the edge of length len above v. depth 0 is the edge left by pruning.
+static void sprDescend(spr_ws *sp, int v, qleaf *A, double len, int depth){
+    int r, r2;
+    qleaf base, B, C;
+    if(depth > 0){
+        C = sprNode(sp, v);
+        sprTry(sp, A, &C, v, len);
+    }
+    if(v <= sp->ntips || depth >= sp->radius) return;
+    base = sprBuf(sp, depth, 0);
+    sprMsg(sp, A, len, &base, 0);
+    B = sprBuf(sp, depth + 1L, 1);
+    for(r = sp->start[v]; r < sp->start[v + 1L]; r++){
+        sprCopy(sp, &base, &B);
+        for(r2 = sp->start[v]; r2 < sp->start[v + 1L]; r2++){
+            if(r2 == r) continue;
+            C = sprNode(sp, sp->kids[r2]);
+            sprMsg(sp, &C, sp->el[sp->kids[r2] - 1L], &B, 1);
+        }
+        sprScale(sp, &B);
+        sprDescend(sp, sp->kids[r], &B, sp->el[sp->kids[r] - 1L], depth + 1L);
+    }
+}
+
+
+// Regraft positions towards the root, M is the message u gets from its
+// child excl, i.e. from the part of the tree already visited.
+static void sprAscend(spr_ws *sp, int u, qleaf *M, int excl, int depth){
+    int i, j, r, r2, root = sp->anc[u] == 0L, nr = sp->nr;
+    size_t krc = (size_t) sp->k * nr * sp->nc;
+    qleaf U, B, D, C, Mn;
+    if(!root){
+        U = sprBuf(sp, depth, 2);
+        C = sprUp(sp, u);
+        sprMsg(sp, &C, sp->el[u - 1L], &U, 0);
+    }
+    // the other subtrees of u
+    B = sprBuf(sp, depth + 1L, 1);
+    for(r = sp->start[u]; r < sp->start[u + 1L]; r++){
+        if(sp->kids[r] == excl) continue;
+        sprCopy(sp, M, &B);
+        if(!root){
+            for(j = 0; j < (int) krc; j++) B.V[j] *= U.V[j];
+            for(i = 0; i < sp->k; i++){
+                for(j = 0; j < nr; j++) B.S[i * nr + j] += U.S[i * nr + j];
+            }
+        }
+        for(r2 = sp->start[u]; r2 < sp->start[u + 1L]; r2++){
+            if(r2 == r || sp->kids[r2] == excl) continue;
+            C = sprNode(sp, sp->kids[r2]);
+            sprMsg(sp, &C, sp->el[sp->kids[r2] - 1L], &B, 1);
+        }
+        sprScale(sp, &B);
+        sprDescend(sp, sp->kids[r], &B, sp->el[sp->kids[r] - 1L], depth + 1L);
+    }
+    if(root) return;
+    // the edge above u
+    D = sprBuf(sp, depth, 3);
+    sprCopy(sp, M, &D);
+    for(r = sp->start[u]; r < sp->start[u + 1L]; r++){
+        if(sp->kids[r] == excl) continue;
+        C = sprNode(sp, sp->kids[r]);
+        sprMsg(sp, &C, sp->el[sp->kids[r] - 1L], &D, 1);
+    }
+    sprScale(sp, &D);
+    C = sprUp(sp, u);
+    sprTry(sp, &C, &D, u, sp->el[u - 1L]);
+    if(depth + 1L < sp->radius){
+        Mn = sprBuf(sp, depth + 1L, 4);
+        sprMsg(sp, &D, sp->el[u - 1L], &Mn, 0);
+        sprAscend(sp, sp->anc[u], &Mn, u, depth + 1L);
+    }
+}
+
+
+// Lazy SPR moves. Each subtree is pruned and regrafted on all edges at most
+// RADIUS edges away, only the 3 edges at the regraft position are optimised
+// (MAXIT sweeps) while the rest of the tree is kept fixed. The partials of
+// the pruned tree are formed from the likelihood vectors of PML4 and their
+// outside counterparts on the way, the subtrees are handled in parallel.
+// Needs a call of PML4 for the binary tree first, PARENT and CHILD are its
+// edges in preorder. Returns a matrix with a row for each pruned subtree s:
+// s, the lower node v of the best regraft edge (0 if there is none), its
+// log-likelihood and the edge lengths parent(v)-p, p-v and p-s, where p is
+// the node joining s to the tree.
+SEXP optSPR(SEXP PARENT, SEXP CHILD, SEXP eig, SEXP EVI, SEXP EL, SEXP W, SEXP G,
+            SEXP NR, SEXP NC, SEXP NTIPS, SEXP CONTRAST, SEXP NCO, SEXP dlist,
+            SEXP WEIGHT, SEXP F0, SEXP TAU, SEXP ASC, SEXP RADIUS, SEXP MAXIT,
+            SEXP EPS, SEXP CTX){
+    int i, h, j, m, nthreads, k=length(W), radius=asInteger(RADIUS);
+    int nc=INTEGER(NC)[0], nr=INTEGER(NR)[0], ntips=INTEGER(NTIPS)[0], nco=INTEGER(NCO)[0];
+    int n=length(PARENT), *parent=INTEGER(PARENT), *child=INTEGER(CHILD), root=parent[0];
+    int *start, *kids, *anc, *USC, *X, *sscratch;
+    ll_ctx *ctx = getLLCtxNode(CTX, nr, ntips, nc, k);
+    double *contrast=REAL(CONTRAST), *el=REAL(EL), *res, *UP, *TIPS, *scratch;
+    size_t nwork, nlev, rc = (size_t) nr * nc;
+    spr_ws sp0, *ws;
+    SEXP RESULT;
+
+    if(radius < 1L) radius = 1L;
+    sp0.eva = REAL(VECTOR_ELT(eig, 0));
+    sp0.eve = REAL(VECTOR_ELT(eig, 1));
+    sp0.evei = REAL(VECTOR_ELT(eig, 2));
+    ll_ctx_eig(ctx, sp0.eva, sp0.eve, sp0.evei);
+    ll_ctx_contrast(ctx, contrast, nco);
+    kernel4_init();
+
+    UP = (double *) R_alloc(rc * k * ntips, sizeof(double));
+    USC = (int *) R_alloc((size_t) nr * k * ntips, sizeof(int));
+    start = (int *) R_alloc(2L * ntips + 2L, sizeof(int));
+    kids = (int *) R_alloc(n, sizeof(int));
+    anc = (int *) R_alloc(2L * ntips + 1L, sizeof(int));
+    nodeChildren(parent, child, n, 2L * ntips, start, kids);
+    for(i = 0; i <= 2L * ntips; i++) anc[i] = 0L;
+    for(m = 0; m < n; m++) anc[child[m]] = parent[m];
+    outsideLL(ctx, tipData(dlist, ntips), parent, child, n, start, kids, el, REAL(G), k, UP, USC,
+              (double *) R_alloc(rc, sizeof(double)));
+    // tips as dense partials, the same for all rate categories
+    TIPS = (double *) R_alloc(rc * ntips, sizeof(double));
+    for(i = 0; i < ntips; i++){
+        X = INTEGER(VECTOR_ELT(dlist, i));
+        for(h = 0; h < nc; h++){
+            for(j = 0; j < nr; j++) TIPS[i * rc + j + h * nr] = contrast[X[j] - 1L + h * nco];
+        }
+    }
+
+    sp0.start = start;
+    sp0.kids = kids;
+    sp0.anc = anc;
+    sp0.SCM = ctx->SCM;
+    sp0.USC = USC;
+    sp0.ntips = ntips;
+    sp0.k = k;
+    sp0.nr = nr;
+    sp0.nc = nc;
+    sp0.radius = radius;
+    sp0.mkv = asLogical(ASC);
+    sp0.maxit = asInteger(MAXIT);
+    sp0.el = el;
+    sp0.LL = ctx->LL;
+    sp0.TIPS = TIPS;
+    sp0.UP = UP;
+    sp0.evi = REAL(EVI);
+    sp0.w = REAL(W);
+    sp0.g = REAL(G);
+    sp0.weight = REAL(WEIGHT);
+    sp0.f0 = REAL(F0);
+    sp0.tau = REAL(TAU)[0];
+    sp0.epsilon = asReal(EPS);
+
+    PROTECT(RESULT = allocMatrix(REALSXP, n, 6));
+    res = REAL(RESULT);
+
+    nthreads = ctx->nthreads;
+    if(n < nthreads) nthreads = n;
+    if(nthreads < 1L) nthreads = 1L;
+    // per thread: the partials of the levels, optStar and P
+    nlev = (size_t) (radius + 1L) * SPR_SLOTS;
+    nwork = nlev * k * rc + STAR_WORK(nr, nc, k) + rc + nc * nc + nc;
+    scratch = (double *) R_alloc(nwork * nthreads, sizeof(double));
+    sscratch = (int *) R_alloc(nlev * k * nr * nthreads, sizeof(int));
+    ws = (spr_ws *) R_alloc(nthreads, sizeof(spr_ws));
+    for(i = 0; i < nthreads; i++){
+        ws[i] = sp0;
+        ws[i].buf = scratch + nwork * i;
+        ws[i].work = ws[i].buf + nlev * k * rc;
+        ws[i].tmp = ws[i].work + STAR_WORK(nr, nc, k);
+        ws[i].P = ws[i].tmp + rc;
+        ws[i].ptmp = ws[i].P + nc * nc;
+        ws[i].sbuf = sscratch + nlev * k * nr * i;
+    }
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1) if(nthreads > 1)
+#endif
+    for(m = 0; m < n; m++){
+        int s = child[m], p = parent[m], t, t2, r, q;
+        double len;
+        qleaf A, C;
+        spr_ws *sp = ws;
+#ifdef _OPENMP
+        sp += omp_get_thread_num();
+#endif
+        sp->S = sprNode(sp, s);
+        sp->els = el[s - 1L];
+        sp->best = R_NegInf;
+        sp->bv = 0L;
+        sp->bel[0] = sp->bel[1] = sp->bel[2] = 0.0;
+        if(p != root && start[p + 1L] - start[p] == 2L){
+            // s and p leave, the edges above p and its other child t merge
+            t = kids[start[p]] == s ? kids[start[p] + 1L] : kids[start[p]];
+            q = anc[p];
+            len = el[p - 1L] + el[t - 1L];
+            A = sprUp(sp, p);
+            sprDescend(sp, t, &A, len, 0L);
+            A = sprBuf(sp, 0L, 4);
+            C = sprNode(sp, t);
+            sprMsg(sp, &C, len, &A, 0);
+            sprAscend(sp, q, &A, p, 0L);
+        }
+        else if(p == root && start[p + 1L] - start[p] == 3L){
+            // the other two children of the root get joined
+            t = t2 = 0L;
+            for(r = start[p]; r < start[p + 1L]; r++){
+                if(kids[r] == s) continue;
+                if(t == 0L) t = kids[r];
+                else t2 = kids[r];
+            }
+            len = el[t - 1L] + el[t2 - 1L];
+            A = sprNode(sp, t2);
+            sprDescend(sp, t, &A, len, 0L);
+            A = sprNode(sp, t);
+            sprDescend(sp, t2, &A, len, 0L);
+        }
+        res[m] = s;
+        res[m + n] = sp->bv;
+        res[m + 2L * n] = sp->best;
+        for(j = 0; j < 3; j++) res[m + (3L + j) * n] = sp->bel[j];
+    }
+    UNPROTECT(1); // RESULT
+    return(RESULT);
+}
+
+
+// Marginal reconstruction of the ancestral states. Needs a call of PML4 for
+// the tree first, PARENT and CHILD are its edges in preorder. At an internal
+// node the likelihood vector is combined with the outside partial of
+// outsideLL, the rate categories are weighted with w and their scaling, INV
+// (invariable sites times inv, or length 0) is added and the states are
+// multiplied with BF. Returns an array nr x nc x (internal nodes) with rows
+// summing to one.
+SEXP ancMarg(SEXP PARENT, SEXP CHILD, SEXP eig, SEXP BF, SEXP EL, SEXP W, SEXP G,
+             SEXP NR, SEXP NC, SEXP NTIPS, SEXP CONTRAST, SEXP NCO, SEXP dlist,
+             SEXP INV, SEXP CTX){
+    int i, nthreads, k=length(W), *start, *kids, *USC, *sscratch;
+    int nc=INTEGER(NC)[0], nr=INTEGER(NR)[0], ntips=INTEGER(NTIPS)[0], nco=INTEGER(NCO)[0];
+    int n=length(PARENT), *parent=INTEGER(PARENT), *child=INTEGER(CHILD), root=parent[0];
+    int nnode = n + 1L - ntips, inv = length(INV) > 0;
+    ll_ctx *ctx = getLLCtxNode(CTX, nr, ntips, nc, k);
+    double *bf=REAL(BF), *el=REAL(EL), *w=REAL(W), *g=REAL(G), *INVP=REAL(INV);
+    double *eva, *eve, *evei, *UP, *scratch, *res;
+    size_t nwork, rc = (size_t) nr * nc;
+    SEXP RESULT;
+
+    eva = REAL(VECTOR_ELT(eig, 0));
+    eve = REAL(VECTOR_ELT(eig, 1));
+    evei = REAL(VECTOR_ELT(eig, 2));
+    ll_ctx_eig(ctx, eva, eve, evei);
+    ll_ctx_contrast(ctx, REAL(CONTRAST), nco);
+    kernel4_init();
+
+    UP = (double *) R_alloc(rc * k * ntips, sizeof(double));
+    USC = (int *) R_alloc((size_t) nr * k * ntips, sizeof(int));
+    start = (int *) R_alloc(2L * ntips + 2L, sizeof(int));
+    kids = (int *) R_alloc(n, sizeof(int));
+    nodeChildren(parent, child, n, 2L * ntips, start, kids);
+    outsideLL(ctx, tipData(dlist, ntips), parent, child, n, start, kids, el, g, k, UP, USC,
+              (double *) R_alloc(rc, sizeof(double)));
+
+    PROTECT(RESULT = alloc3DArray(REALSXP, nr, nc, nnode));
+    res = REAL(RESULT);
+
+    nthreads = ctx->nthreads;
+    if(nnode < nthreads) nthreads = nnode;
+    if(nthreads < 1L) nthreads = 1L;
+    nwork = k * rc + nc * nc + nc;
+    scratch = (double *) R_alloc(nwork * nthreads, sizeof(double));
+    sscratch = (int *) R_alloc((size_t) k * nr * nthreads, sizeof(int));
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1) if(nthreads > 1)
+#endif
+    for(i = 0; i < nnode; i++){
+        int v = ntips + 1L + i, j, h, r, cmin, *sc = sscratch, *S;
+        double *M = scratch, *P, *ptmp, *out = res + i * rc, *L, f, rs;
+        int tid = 0;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        M += nwork * tid;
+        sc += (size_t) k * nr * tid;
+        P = M + k * rc;
+        ptmp = P + nc * nc;
+        for(r = 0; r < k; r++){
+            L = &ctx->LL[LINDEX(v, r)];
+            S = &ctx->SCM[(v - ntips - 1L) * nr + r * ntips * nr];
+            if(v != root){
+                getPw(eva, eve, evei, nc, el[v - 1L], g[r], ptmp, P);
+                vecP(&UP[LINDEX(v, r)], P, nr, nc, &M[r * rc]);
+                for(j = 0; j < (int) rc; j++) M[r * rc + j] *= L[j];
+                for(j = 0; j < nr; j++) sc[r * nr + j] = S[j] + USC[(v - ntips - 1L) * nr + r * ntips * nr + j];
+            }
+            else{
+                memcpy(&M[r * rc], L, rc * sizeof(double));
+                memcpy(&sc[r * nr], S, nr * sizeof(int));
+            }
+        }
+        for(j = 0; j < nr; j++){
+            cmin = sc[j];
+            for(r = 1; r < k; r++) if(sc[r * nr + j] < cmin) cmin = sc[r * nr + j];
+            for(h = 0; h < nc; h++) out[j + h * nr] = 0.0;
+            for(r = 0; r < k; r++){
+                f = w[r] * pow(ScaleEPS, sc[r * nr + j] - cmin);
+                for(h = 0; h < nc; h++) out[j + h * nr] += f * M[r * rc + j + h * nr];
+            }
+            if(inv){
+                // the invariable sites are not scaled
+                rs = 0.0;
+                for(h = 0; h < nc; h++) rs += INVP[j + h * nr];
+                if(rs > 0.0){
+                    f = pow(ScaleEPS, cmin);
+                    for(h = 0; h < nc; h++) out[j + h * nr] = f * out[j + h * nr] + INVP[j + h * nr];
+                }
+            }
+            rs = 0.0;
+            for(h = 0; h < nc; h++){
+                out[j + h * nr] *= bf[h];
+                rs += out[j + h * nr];
+            }
+            for(h = 0; h < nc; h++) out[j + h * nr] /= rs;
+        }
+    }
+    UNPROTECT(1); // RESULT
+    return(RESULT);
+}
+
+
+// sites per block in ancJoint
+#define ANC_BLOCK 256L
+
+// Joint reconstruction of the ancestral states (Pupko et al. 2000), the
+// dynamic programming runs on log probabilities for blocks of sites. For
+// rate heterogeneity the rate category (or the invariable sites, INV is
+// the matrix of invariable sites times inv or length 0) is maximised over
+// together with the states, like in Pupko et al. (2002). PARENT and CHILD
+// are the edges in preorder. Returns an integer matrix nr x (internal
+// nodes) of states 1, ..., nc.
+SEXP ancJoint(SEXP PARENT, SEXP CHILD, SEXP eig, SEXP BF, SEXP EL, SEXP W, SEXP G,
+              SEXP NR, SEXP NC, SEXP NTIPS, SEXP CONTRAST, SEXP NCO, SEXP dlist,
+              SEXP INV){
+    int i, j, h, r, m, s, s0, bn, c, p, v, x, best, k=length(W), inv=length(INV) > 0;
+    int nc=INTEGER(NC)[0], nr=INTEGER(NR)[0], ntips=INTEGER(NTIPS)[0], nco=INTEGER(NCO)[0];
+    int n=length(PARENT), *parent=INTEGER(PARENT), *child=INTEGER(CHILD), root=parent[0];
+    int nnode = n + 1L - ntips, *states, *res, **X;
+    double *bf=REAL(BF), *el=REAL(EL), *w=REAL(W), *g=REAL(G), *INVP=REAL(INV);
+    double *contrast=REAL(CONTRAST), *eva, *eve, *evei, *lP, *tip, *C, *score, *msg;
+    double *ptmp, *lbf, tmp, mx;
+    unsigned char *A;
+    size_t nc2 = (size_t) nc * nc, bnc = (size_t) ANC_BLOCK * nc;
+    SEXP RESULT;
+
+    if(nc > 255) error("too many states for the joint reconstruction");
+    eva = REAL(VECTOR_ELT(eig, 0));
+    eve = REAL(VECTOR_ELT(eig, 1));
+    evei = REAL(VECTOR_ELT(eig, 2));
+    X = tipData(dlist, ntips);
+
+    // log transition probabilities of the edges, the parent state i to the
+    // child state j is lP[j + i * nc] (see getP)
+    lP = (double *) R_alloc(nc2 * n * k, sizeof(double));
+    ptmp = (double *) R_alloc(nc, sizeof(double));
+    for(r = 0; r < k; r++){
+        for(m = 0; m < n; m++){
+            getPw(eva, eve, evei, nc, el[child[m] - 1L], g[r], ptmp, &lP[(r * n + m) * nc2]);
+            for(j = 0; j < (int) nc2; j++) lP[(r * n + m) * nc2 + j] = log(lP[(r * n + m) * nc2 + j]);
+        }
+    }
+    // tip edges: max over the states compatible with the observed character,
+    // the parent state i and character x is tip[(r * n + m) * nco * nc + x + i * nco]
+    tip = (double *) R_alloc((size_t) nco * nc * n * k, sizeof(double));
+    for(r = 0; r < k; r++){
+        for(m = 0; m < n; m++){
+            if(child[m] > ntips) continue;
+            double *P = &lP[(r * n + m) * nc2], *T = &tip[(size_t) (r * n + m) * nco * nc];
+            for(x = 0; x < nco; x++){
+                for(i = 0; i < nc; i++){
+                    mx = R_NegInf;
+                    for(h = 0; h < nc; h++){
+                        if(contrast[x + h * nco] > 0.0){
+                            tmp = P[h + i * nc] + log(contrast[x + h * nco]);
+                            if(tmp > mx) mx = tmp;
+                        }
+                    }
+                    T[x + i * nco] = mx;
+                }
+            }
+        }
+    }
+    lbf = (double *) R_alloc(nc, sizeof(double));
+    for(i = 0; i < nc; i++) lbf[i] = log(bf[i]);
+
+    C = (double *) R_alloc(bnc * nnode, sizeof(double));
+    A = (unsigned char *) R_alloc(bnc * nnode, sizeof(unsigned char));
+    msg = (double *) R_alloc(bnc, sizeof(double));
+    score = (double *) R_alloc(ANC_BLOCK, sizeof(double));
+    states = (int *) R_alloc((size_t) ANC_BLOCK * nnode, sizeof(int));
+
+    PROTECT(RESULT = allocMatrix(INTSXP, nr, nnode));
+    res = INTEGER(RESULT);
+
+    for(s0 = 0; s0 < nr; s0 += ANC_BLOCK){
+        bn = nr - s0 < ANC_BLOCK ? nr - s0 : ANC_BLOCK;
+        for(s = 0; s < bn; s++) score[s] = R_NegInf;
+        for(r = 0; r < k; r++){
+            for(j = 0; j < (int) bnc * nnode; j++) C[j] = 0.0;
+            // postorder
+            for(m = n - 1L; m >= 0; m--){
+                c = child[m];
+                p = parent[m];
+                double *P = &lP[(r * n + m) * nc2], *Cp = &C[(p - ntips - 1L) * bnc];
+                if(c <= ntips){
+                    double *T = &tip[(size_t) (r * n + m) * nco * nc];
+                    for(i = 0; i < nc; i++){
+                        for(s = 0; s < bn; s++) Cp[s + i * ANC_BLOCK] += T[X[c - 1L][s0 + s] - 1L + i * nco];
+                    }
+                }
+                else{
+                    double *Cc = &C[(c - ntips - 1L) * bnc];
+                    unsigned char *Ac = &A[(c - ntips - 1L) * bnc];
+                    for(i = 0; i < nc; i++){
+                        for(s = 0; s < bn; s++){
+                            msg[s] = P[i * nc] + Cc[s];
+                            Ac[s + i * ANC_BLOCK] = 0;
+                        }
+                        for(h = 1; h < nc; h++){
+                            for(s = 0; s < bn; s++){
+                                tmp = P[h + i * nc] + Cc[s + h * ANC_BLOCK];
+                                if(tmp > msg[s]){
+                                    msg[s] = tmp;
+                                    Ac[s + i * ANC_BLOCK] = (unsigned char) h;
+                                }
+                            }
+                        }
+                        for(s = 0; s < bn; s++) Cp[s + i * ANC_BLOCK] += msg[s];
+                    }
+                }
+            }
+            // root and traceback, keep the sites where this rate is better
+            double *Cr = &C[(root - ntips - 1L) * bnc];
+            for(s = 0; s < bn; s++){
+                best = 0;
+                mx = lbf[0] + Cr[s];
+                for(h = 1; h < nc; h++){
+                    tmp = lbf[h] + Cr[s + h * ANC_BLOCK];
+                    if(tmp > mx){
+                        mx = tmp;
+                        best = h;
+                    }
+                }
+                mx += log(w[r]);
+                if(mx <= score[s]) continue;
+                score[s] = mx;
+                states[(root - ntips - 1L) * ANC_BLOCK + s] = best;
+                for(m = 0; m < n; m++){
+                    c = child[m];
+                    if(c <= ntips) continue;
+                    v = states[(parent[m] - ntips - 1L) * ANC_BLOCK + s];
+                    states[(c - ntips - 1L) * ANC_BLOCK + s] = A[(c - ntips - 1L) * bnc + s + v * ANC_BLOCK];
+                }
+            }
+        }
+        for(s = 0; s < bn; s++){
+            if(inv){
+                best = 0;
+                mx = R_NegInf;
+                for(h = 0; h < nc; h++){
+                    if(INVP[s0 + s + h * nr] > 0.0){
+                        tmp = log(INVP[s0 + s + h * nr]) + lbf[h];
+                        if(tmp > mx){
+                            mx = tmp;
+                            best = h;
+                        }
+                    }
+                }
+                if(mx > score[s]){
+                    for(v = 0; v < nnode; v++) states[v * ANC_BLOCK + s] = best;
+                }
+            }
+            for(v = 0; v < nnode; v++) res[s0 + s + v * nr] = states[v * ANC_BLOCK + s] + 1L;
+        }
+    }
+    UNPROTECT(1); // RESULT
+    return(RESULT);
+}
+
+
+// index drawn with probabilities proportional to p
+static int sampleIndex(double *p, int n){
+    int i;
+    double u, sum = 0.0;
+    for(i = 0; i < n; i++) sum += p[i];
+    u = unif_rand() * sum;
+    for(i = 0; i < n - 1L; i++){
+        u -= p[i];
+        if(u < 0.0) break;
+    }
+    return i;
+}
+
+
+// N draws of the ancestral states from their joint posterior. Needs a call
+// of PML4 for the tree first, PARENT and CHILD are its edges in preorder.
+// For each site the rate category (or the invariable sites, INV as in
+// ancMarg) is drawn first, then the states from the root to the tips.
+// Returns an integer array nr x (internal nodes) x N of states 1, ..., nc.
+SEXP ancSample(SEXP PARENT, SEXP CHILD, SEXP eig, SEXP BF, SEXP EL, SEXP W, SEXP G,
+               SEXP NR, SEXP NC, SEXP NTIPS, SEXP INV, SEXP N, SEXP CTX){
+    int i, j, h, r, m, s, c, v, cmin, k=length(W), inv=length(INV) > 0, nsim=asInteger(N);
+    int nc=INTEGER(NC)[0], nr=INTEGER(NR)[0], ntips=INTEGER(NTIPS)[0];
+    int n=length(PARENT), *parent=INTEGER(PARENT), *child=INTEGER(CHILD), root=parent[0];
+    int nnode = n + 1L - ntips, *res, *sc;
+    ll_ctx *ctx = getLLCtxNode(CTX, nr, ntips, nc, k);
+    double *bf=REAL(BF), *el=REAL(EL), *w=REAL(W), *g=REAL(G), *INVP=REAL(INV);
+    double *eva, *eve, *evei, *P, *Pv, *ptmp, *cw, *pr, *L, u, f;
+    size_t nc2 = (size_t) nc * nc;
+    SEXP RESULT;
+
+    eva = REAL(VECTOR_ELT(eig, 0));
+    eve = REAL(VECTOR_ELT(eig, 1));
+    evei = REAL(VECTOR_ELT(eig, 2));
+    P = (double *) R_alloc(nc2 * n * k, sizeof(double));
+    ptmp = (double *) R_alloc(nc, sizeof(double));
+    for(r = 0; r < k; r++){
+        for(m = 0; m < n; m++) getPw(eva, eve, evei, nc, el[child[m] - 1L], g[r], ptmp, &P[(r * n + m) * nc2]);
+    }
+    // weights of the rate categories and the invariable sites for each site
+    cw = (double *) R_alloc((size_t) (k + 1L) * nr, sizeof(double));
+    pr = (double *) R_alloc(nc, sizeof(double));
+    sc = (int *) R_alloc(k, sizeof(int));
+    for(s = 0; s < nr; s++){
+        for(r = 0; r < k; r++) sc[r] = ctx->SCM[(root - ntips - 1L) * nr + r * ntips * nr + s];
+        cmin = sc[0];
+        for(r = 1; r < k; r++) if(sc[r] < cmin) cmin = sc[r];
+        for(r = 0; r < k; r++){
+            L = &ctx->LL[LINDEX(root, r)];
+            f = 0.0;
+            for(h = 0; h < nc; h++) f += bf[h] * L[s + h * nr];
+            cw[s * (k + 1L) + r] = w[r] * pow(ScaleEPS, sc[r] - cmin) * f;
+        }
+        f = 0.0;
+        if(inv){
+            for(h = 0; h < nc; h++) f += bf[h] * INVP[s + h * nr];
+            if(f > 0.0 && cmin > 0){
+                u = pow(ScaleEPS, cmin);
+                for(r = 0; r < k; r++) cw[s * (k + 1L) + r] *= u;
+            }
+        }
+        cw[s * (k + 1L) + k] = f;
+    }
+
+    PROTECT(RESULT = alloc3DArray(INTSXP, nr, nnode, nsim));
+    res = INTEGER(RESULT);
+    GetRNGstate();
+    for(i = 0; i < nsim; i++){
+        int *out = res + (size_t) i * nr * nnode;
+        for(s = 0; s < nr; s++){
+            r = sampleIndex(&cw[s * (k + 1L)], k + 1L);
+            if(r == k){
+                for(h = 0; h < nc; h++) pr[h] = bf[h] * INVP[s + h * nr];
+                v = sampleIndex(pr, nc);
+                for(j = 0; j < nnode; j++) out[s + j * nr] = v + 1L;
+                continue;
+            }
+            L = &ctx->LL[LINDEX(root, r)];
+            for(h = 0; h < nc; h++) pr[h] = bf[h] * L[s + h * nr];
+            out[s + (root - ntips - 1L) * nr] = sampleIndex(pr, nc) + 1L;
+            for(m = 0; m < n; m++){
+                c = child[m];
+                if(c <= ntips) continue;
+                v = out[s + (parent[m] - ntips - 1L) * nr] - 1L;
+                L = &ctx->LL[LINDEX(c, r)];
+                Pv = &P[(r * n + m) * nc2 + v * nc];
+                for(h = 0; h < nc; h++) pr[h] = Pv[h] * L[s + h * nr];
+                out[s + (c - ntips - 1L) * nr] = sampleIndex(pr, nc) + 1L;
+            }
+        }
+    }
+    PutRNGstate();
+    UNPROTECT(1); // RESULT
+    return(RESULT);
+}
+
+
+/*
+ * Mixture weights for fixed site likelihoods of the components.
+ * The likelihood of site i is c0[i] + sum_j LL[i, j] * w[j], the
+ * weights keep the sum they start with. Each EM step is a closed form
+ * reweighting in O(nr * m), no tree traversal needed. LL and C0 may be
+ * scaled by a common factor per site, the log-likelihood returned
+ * (second list element) does not contain these factors.
+ */
+SEXP optMixW(SEXP LL, SEXP C0, SEXP WEIGHT, SEXP W, SEXP MAXIT, SEXP EPS){
+    int i, j, it, nr=nrows(LL), m=ncols(LL), maxit=asInteger(MAXIT);
+    double eps=asReal(EPS), *ll=REAL(LL), *weight=REAL(WEIGHT), *c0=NULL;
+    double *w, *nw, *site, tot=0.0, sn, lold, lnew=0.0;
+    SEXP RESULT, RW, LOGLIK;
+    if(length(C0) == nr) c0 = REAL(C0);
+    nw = (double *) R_alloc(m, sizeof(double));
+    site = (double *) R_alloc(nr, sizeof(double));
+    PROTECT(RESULT = allocVector(VECSXP, 2));
+    PROTECT(RW = allocVector(REALSXP, m));
+    PROTECT(LOGLIK = allocVector(REALSXP, 1));
+    w = REAL(RW);
+    for(j = 0; j < m; j++){
+        w[j] = REAL(W)[j];
+        tot += w[j];
+    }
+    for(it = 0; it <= maxit; it++){
+        lold = lnew;
+        lnew = 0.0;
+        for(i = 0; i < nr; i++){
+            site[i] = (c0 == NULL) ? 0.0 : c0[i];
+            for(j = 0; j < m; j++) site[i] += ll[i + j * nr] * w[j];
+            if(weight[i] > 0.0) lnew += weight[i] * log(site[i]);
+        }
+        if(it > 0 && (lnew - lold) <= eps * fabs(lnew)) break;
+        if(it == maxit) break;
+        // expected counts of the components
+        sn = 0.0;
+        for(j = 0; j < m; j++){
+            nw[j] = 0.0;
+            for(i = 0; i < nr; i++){
+                if(weight[i] > 0.0 && site[i] > 0.0)
+                    nw[j] += weight[i] * ll[i + j * nr] / site[i];
+            }
+            nw[j] *= w[j];
+            sn += nw[j];
+        }
+        if(!(sn > 0.0)) break;
+        for(j = 0; j < m; j++) w[j] = tot * nw[j] / sn;
+    }
+    REAL(LOGLIK)[0] = lnew;
+    SET_VECTOR_ELT(RESULT, 0, RW);
+    SET_VECTOR_ELT(RESULT, 1, LOGLIK);
+    UNPROTECT(3);
+    return(RESULT);
+}
+
+
+// Gradient of the log-likelihood with respect to the generator M of the
+// substitution process (M = eve %*% diag(eva) %*% evei, see edQt) and the
+// direct dependence on the base frequencies bf at the root and of the
+// invariable sites. Needs PML4 to have been run in ctx, PARENT and CHILD
+// are the edges in preorder, SITELIK the log site likelihoods including the
+// invariable sites INV (times inv, or length 0). The derivative of
+// exp(t * M) follows from the eigen decomposition, the contributions of
+// all edges are summed up in the eigen basis. Returns list(dM, dbf).
+SEXP pmlGrad(SEXP PARENT, SEXP CHILD, SEXP eig, SEXP BF, SEXP EL, SEXP W, SEXP G,
+             SEXP NR, SEXP NC, SEXP NTIPS, SEXP CONTRAST, SEXP NCO, SEXP dlist,
+             SEXP WEIGHT, SEXP SITELIK, SEXP INV, SEXP CTX){
+    int i, j, h, m, r, nthreads, k=length(W), *start, *kids, *USC, *sscratch, **X;
+    int nc=INTEGER(NC)[0], nr=INTEGER(NR)[0], ntips=INTEGER(NTIPS)[0], nco=INTEGER(NCO)[0];
+    int n=length(PARENT), *parent=INTEGER(PARENT), *child=INTEGER(CHILD), root=parent[0];
+    int inv = length(INV) > 0;
+    ll_ctx *ctx = getLLCtxNode(CTX, nr, ntips, nc, k);
+    double *bf=REAL(BF), *el=REAL(EL), *w=REAL(W), *g=REAL(G), *INVP=REAL(INV);
+    double *weight=REAL(WEIGHT), *sitelik=REAL(SITELIK), *contrast=REAL(CONTRAST);
+    double *eva, *eve, *evei, *UP, *scratch, *K, *dM, *dbf, *tmp;
+    size_t nwork, rc = (size_t) nr * nc, nc2 = (size_t) nc * nc;
+    SEXP RESULT, DM, DBF;
+
+    eva = REAL(VECTOR_ELT(eig, 0));
+    eve = REAL(VECTOR_ELT(eig, 1));
+    evei = REAL(VECTOR_ELT(eig, 2));
+    ll_ctx_eig(ctx, eva, eve, evei);
+    ll_ctx_contrast(ctx, contrast, nco);
+    kernel4_init();
+
+    UP = (double *) R_alloc(rc * k * ntips, sizeof(double));
+    USC = (int *) R_alloc((size_t) nr * k * ntips, sizeof(int));
+    start = (int *) R_alloc(2L * ntips + 2L, sizeof(int));
+    kids = (int *) R_alloc(n, sizeof(int));
+    tmp = (double *) R_alloc(rc > nc2 ? rc : nc2, sizeof(double));
+    nodeChildren(parent, child, n, 2L * ntips, start, kids);
+    X = tipData(dlist, ntips);
+    outsideLL(ctx, X, parent, child, n, start, kids, el, g, k, UP, USC, tmp);
+    // the threads only read the transition matrices and tip tables
+    for(m = 0; m < n; m++){
+        for(r = 0; r < k; r++){
+            if(child[m] > ntips) getPctx(ctx, child[m], r, el[child[m] - 1L], g[r]);
+            else getTctx(ctx, child[m], r, el[child[m] - 1L], g[r]);
+        }
+    }
+
+    PROTECT(RESULT = allocVector(VECSXP, 2));
+    PROTECT(DM = allocMatrix(REALSXP, nc, nc));
+    PROTECT(DBF = allocVector(REALSXP, nc));
+    dM = REAL(DM);
+    dbf = REAL(DBF);
+    for(h = 0; h < nc; h++) dbf[h] = 0.0;
+
+    nthreads = ctx->nthreads;
+    if(n < nthreads) nthreads = n;
+    if(nthreads < 1L) nthreads = 1L;
+    nwork = 3L * rc + 4L * nc2;
+    scratch = (double *) R_alloc(nwork * nthreads, sizeof(double));
+    sscratch = (int *) R_alloc((size_t) nr * nthreads, sizeof(int));
+    for(j = 0; j < (int) (nwork * nthreads); j++) scratch[j] = 0.0;
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1) if(nthreads > 1)
+#endif
+    for(m = 0; m < n; m++){
+        int v = child[m], p = parent[m], a, b, r, s, *su, *sd, *x = NULL;
+        double *FD = scratch, *Ut, *tt, *H, *Y, *T1, *Kt, *U, *D, *P, t, d, f;
+        int tid = 0;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        FD += nwork * tid;
+        Ut = FD + rc;
+        tt = Ut + rc;
+        H = tt + rc;
+        Y = H + nc2;
+        T1 = Y + nc2;
+        Kt = T1 + nc2;
+        su = sscratch + (size_t) nr * tid;
+        if(v <= ntips) x = X[v - 1L];
+        for(r = 0; r < k; r++){
+            t = el[v - 1L] * g[r];
+            P = getPctx(ctx, v, r, el[v - 1L], g[r]);
+            if(v > ntips){
+                U = &UP[LINDEX(v, r)];
+                su = &USC[(v - ntips - 1L) * nr + r * ntips * nr];
+                D = &ctx->LL[LINDEX(v, r)];
+                sd = &ctx->SCM[(v - ntips - 1L) * nr + r * ntips * nr];
+            }
+            else{
+                su = sscratch + (size_t) nr * tid;
+                outsideNode(ctx, X, p, v, r, root, start, kids, el, g, UP, USC,
+                            Ut, su, tt);
+                U = Ut;
+                D = NULL;
+                sd = NULL;
+            }
+            // FD = D * weight * w / L, the scaling of U and D cancels out
+            for(s = 0; s < nr; s++){
+                f = weight[s] * w[r] * exp((su[s] + (sd == NULL ? 0 : sd[s])) * LOG_SCALE_EPS - sitelik[s]);
+                if(D != NULL) for(a = 0; a < nc; a++) FD[s + a * nr] = f * D[s + a * nr];
+                else for(a = 0; a < nc; a++) FD[s + a * nr] = f * contrast[x[s] - 1L + a * nco];
+            }
+            // H[a, b] = sum over sites FD[, a] * U[, b]
+            F77_CALL(dgemm)("T", "N", &nc, &nc, &nr, &one, FD, &nr, U, &nr, &zero, H, &nc FCONE FCONE);
+            if(m == 0){
+                // the root frequencies, any edge will do
+                for(b = 0; b < nc; b++){
+                    for(a = 0; a < nc; a++) dbf[b] += H[a + b * nc] * P[a + b * nc];
+                }
+            }
+            for(b = 0; b < nc; b++){
+                for(a = 0; a < nc; a++) H[a + b * nc] *= bf[b];
+            }
+            // Y = t(eve) %*% H %*% t(evei)
+            F77_CALL(dgemm)("T", "N", &nc, &nc, &nc, &one, eve, &nc, H, &nc, &zero, T1, &nc FCONE FCONE);
+            F77_CALL(dgemm)("N", "T", &nc, &nc, &nc, &one, T1, &nc, evei, &nc, &zero, Y, &nc FCONE FCONE);
+            for(b = 0; b < nc; b++){
+                for(a = 0; a < nc; a++){
+                    d = eva[a] - eva[b];
+                    f = (d == 0.0) ? t * exp(t * eva[a]) : exp(t * eva[b]) * expm1(t * d) / d;
+                    Kt[a + b * nc] += Y[a + b * nc] * f;
+                }
+            }
+        }
+    }
+    K = (double *) R_alloc(nc2, sizeof(double));
+    for(j = 0; j < (int) nc2; j++){
+        K[j] = 0.0;
+        for(i = 0; i < nthreads; i++) K[j] += scratch[i * nwork + 3L * rc + 3L * nc2 + j];
+    }
+    // dM = t(evei) %*% K %*% t(eve)
+    F77_CALL(dgemm)("T", "N", &nc, &nc, &nc, &one, evei, &nc, K, &nc, &zero, tmp, &nc FCONE FCONE);
+    F77_CALL(dgemm)("N", "T", &nc, &nc, &nc, &one, tmp, &nc, eve, &nc, &zero, dM, &nc FCONE FCONE);
+    if(inv){
+        for(h = 0; h < nc; h++){
+            for(j = 0; j < nr; j++){
+                if(INVP[j + h * nr] > 0.0) dbf[h] += weight[j] * INVP[j + h * nr] * exp(-sitelik[j]);
+            }
+        }
+    }
+    SET_VECTOR_ELT(RESULT, 0, DM);
+    SET_VECTOR_ELT(RESULT, 1, DBF);
+    UNPROTECT(3);
+    return(RESULT);
+}
+
+
+// A rooted tree for partLL: parent and child are the edges in postorder,
+// node and edge the 0-based indices for lll3, ppar and pch the edges in
+// preorder and start and kids the children of the nodes (see nodeChildren).
+typedef struct part_tree {
+    int n, ntips, *parent, *child, *node, *edge, *ppar, *pch, *start, *kids;
+} part_tree;
+
+
+static void partTree(int *parent, int *child, int n, int ntips, part_tree *tr){
+    int i;
+    tr->n = n;
+    tr->ntips = ntips;
+    tr->parent = parent;
+    tr->child = child;
+    tr->node = (int *) R_alloc(n, sizeof(int));
+    tr->edge = (int *) R_alloc(n, sizeof(int));
+    tr->ppar = (int *) R_alloc(n, sizeof(int));
+    tr->pch = (int *) R_alloc(n, sizeof(int));
+    for(i = 0; i < n; i++){
+        tr->node[i] = parent[i] - ntips - 1L;
+        tr->edge[i] = child[i] - 1L;
+        // reversed postorder, parents come before their children
+        tr->ppar[i] = parent[n - 1L - i];
+        tr->pch[i] = child[n - 1L - i];
+    }
+    tr->start = (int *) R_alloc(2L * ntips + 2L, sizeof(int));
+    tr->kids = (int *) R_alloc(n, sizeof(int));
+    nodeChildren(tr->ppar, tr->pch, n, 2L * ntips, tr->start, tr->kids);
+}
+
+
+// doubles and integers partLL needs for nr sites, the maxima are kept in
+// nwork and niwork
+static void partWork(int nr, int nc, int nco, int k, part_tree *tr, int deriv,
+                     size_t *nwork, size_t *niwork){
+    size_t len, rc = (size_t) nr * nc;
+    int n = tr->n, ntips = tr->ntips;
+    // tables, rtmp, cherry table, site likelihoods per rate
+    len = rc + (size_t) nco * nco * nc + (size_t) nr * k;
+    if(deriv) len += rc * k * ntips + 2L * (size_t) nr * n + 3L * rc + (size_t) nco * nc + (size_t) nc * nc + nc;
+    if(len > *nwork) *nwork = len;
+    len = (size_t) nr * k + (deriv ? (size_t) nr * k * ntips + nr : 0L);
+    if(len > *niwork) *niwork = len;
+}
+
+
+// Log likelihood of the ctx->nr sites with tip data X for one model,
+// eigen system and contrast have to be set in ctx. el are the edge lengths
+// by child node, ll0 the likelihood of the invariable sites. The site log
+// likelihoods are written to sitelik. If sc is not NULL the derivatives of
+// the site log likelihoods with respect to the log edge lengths (edges in
+// postorder) are computed too, their weighted sums are added to sc and the
+// weighted outer products to Ft (n x n). tab needs n pointers, work and
+// iwork the space from partWork. Touches no R objects, so it can run in a
+// thread.
+static double partLL(ll_ctx *ctx, int **X, part_tree *tr, double *el, double *bf, double *g,
+                     double *w, int k, double *ll0, double *weight, double *sitelik,
+                     double **tab, double *work, int *iwork, double *sc, double *Ft){
+    int nr = ctx->nr, nc = ctx->nc, nco = ctx->nco, ntips = tr->ntips, n = tr->n;
+    int b, h, m, r, s, v, e, mn, *child = tr->child, *ppar = tr->ppar, *pch = tr->pch;
+    int *SC, *USC, *su, *sd;
+    double *rtmp, *TT, *tmp, *UP, *dl, *wdl, *Ut, *tt, *DdP, *TdP, *dP, *dPtmp, *U;
+    double x, f, loglik = 0.0;
+    size_t rc = (size_t) nr * nc, indLL = rc * ntips;
+
+    rtmp = work;
+    TT = rtmp + rc;
+    tmp = TT + (size_t) nco * nco * nc;
+    SC = iwork;
+    for(r = 0; r < k; r++){
+        for(h = 0; h < n; h++){
+            if(child[h] <= ntips) tab[h] = getTctx(ctx, child[h], r, el[child[h] - 1L], g[r]);
+            else tab[h] = getPctx(ctx, child[h], r, el[child[h] - 1L], g[r]);
+        }
+        lll3(tab, X, 0L, nr, nr, nc, tr->node, tr->edge, ntips, nco, n, &SC[(size_t) nr * r],
+             bf, &tmp[(size_t) nr * r], &ctx->LL[indLL * r], &ctx->SCM[(size_t) nr * ntips * r],
+             rtmp, TT, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+    }
+    for(s = 0; s < nr; s++){
+        mn = SC[s];
+        for(r = 1; r < k; r++) if(SC[s + r * nr] < mn) mn = SC[s + r * nr];
+        x = 0.0;
+        for(r = 0; r < k; r++) x += w[r] * exp(LOG_SCALE_EPS * (SC[s + r * nr] - mn)) * tmp[s + r * nr];
+        sitelik[s] = log(x) + LOG_SCALE_EPS * mn;
+        if(ll0[s] > 0.0) sitelik[s] = log(exp(sitelik[s]) + ll0[s]);
+        loglik += weight[s] * sitelik[s];
+    }
+    if(sc == NULL) return loglik;
+
+    // site derivatives dl[s, e] of the edges e (in postorder)
+    UP = tmp + (size_t) nr * k;
+    dl = UP + rc * k * ntips;
+    wdl = dl + (size_t) nr * n;
+    Ut = wdl + (size_t) nr * n;
+    tt = Ut + rc;
+    DdP = tt + rc;
+    TdP = DdP + rc;
+    dP = TdP + (size_t) nco * nc;
+    dPtmp = dP + (size_t) nc * nc;
+    USC = SC + (size_t) nr * k;
+    outsideLL(ctx, X, ppar, pch, n, tr->start, tr->kids, el, g, k, UP, USC, tt);
+    for(s = 0; s < nr * n; s++) dl[s] = 0.0;
+    for(m = 0; m < n; m++){
+        v = pch[m];
+        e = n - 1L - m;
+        for(r = 0; r < k; r++){
+            getdPw(ctx->Peig, &ctx->Peig[nc], &ctx->Peig[nc + nc * nc], nc, el[v - 1L], g[r], dPtmp, dP);
+            if(v > ntips){
+                U = &UP[LINDEX(v, r)];
+                su = &USC[(v - ntips - 1L) * nr + r * ntips * nr];
+                sd = &ctx->SCM[(v - ntips - 1L) * nr + r * ntips * nr];
+                vecP(&ctx->LL[LINDEX(v, r)], dP, nr, nc, DdP);
+            }
+            else{
+                su = USC + (size_t) nr * k * ntips;
+                outsideNode(ctx, X, ppar[m], v, r, ppar[0], tr->start, tr->kids, el, g, UP, USC, Ut, su, tt);
+                U = Ut;
+                sd = NULL;
+                F77_CALL(dgemm)("N", "N", &nco, &nc, &nc, &one, ctx->contrast, &nco, dP, &nc, &zero, TdP, &nco FCONE FCONE);
+                tipLookup(X[v - 1L], TdP, nr, nr, nc, nco, DdP);
+            }
+            for(s = 0; s < nr; s++){
+                x = 0.0;
+                for(b = 0; b < nc; b++) x += bf[b] * U[s + b * nr] * DdP[s + b * nr];
+                f = w[r] * exp((su[s] + (sd == NULL ? 0 : sd[s])) * LOG_SCALE_EPS - sitelik[s]);
+                dl[s + (size_t) e * nr] += f * x;
+            }
         }
     }
-    SET_VECTOR_ELT(ans, ni, result);
-    UNPROTECT(2); // result ans
-    return(ans);
+    for(e = 0; e < n; e++){
+        for(s = 0; s < nr; s++){
+            wdl[s + (size_t) e * nr] = weight[s] * dl[s + (size_t) e * nr];
+            sc[e] += wdl[s + (size_t) e * nr];
+        }
+    }
+    F77_CALL(dgemm)("T", "N", &n, &n, &nr, &one, dl, &nr, wdl, &nr, &one, Ft, &n FCONE FCONE);
+    return loglik;
+}
+
+
+// score and outer products summed over the nthreads blocks of size len
+// starting at offset off in scratch
+static SEXP partDeriv(SEXP RESULT, double *scratch, size_t len, size_t off, int n, int nthreads){
+    int i, j;
+    double *score, *FM;
+    SEXP SCORE, F;
+    PROTECT(SCORE = allocVector(REALSXP, n));
+    PROTECT(F = allocMatrix(REALSXP, n, n));
+    score = REAL(SCORE);
+    FM = REAL(F);
+    for(j = 0; j < n; j++) score[j] = 0.0;
+    for(j = 0; j < n * n; j++) FM[j] = 0.0;
+    for(i = 0; i < nthreads; i++){
+        for(j = 0; j < n; j++) score[j] += scratch[len * i + off + j];
+        for(j = 0; j < n * n; j++) FM[j] += scratch[len * i + off + n + j];
+    }
+    SET_VECTOR_ELT(RESULT, 2, SCORE);
+    SET_VECTOR_ELT(RESULT, 3, F);
+    UNPROTECT(2);
+    return RESULT;
+}
+
+
+/*
+ * Partitioned likelihood: partitions with their own data, model and rate
+ * categories share one topology and each has its own likelihood context
+ * (CTXS, one pml_context per partition). The partitions are evaluated in
+ * parallel, one partition per thread. EDGE is the edge matrix in postorder,
+ * EL has the edge lengths of the partitions in its columns and MODELS holds
+ * list(eig, bf, g, w, ll.0, weight) for each partition, ll.0 being the
+ * likelihood of the invariable sites. Returns list(loglik, siteLik) and with
+ * DERIV also the score (derivatives with respect to the log edge lengths)
+ * and the outer product of the site derivatives, summed over the
+ * partitions, for the scoring steps in optimPartEdge.
+ */
+SEXP PMLPart(SEXP EDGE, SEXP EL, SEXP DATA, SEXP MODELS, SEXP CTXS, SEXP DERIV, SEXP THREADS){
+    int i, j, q, np = length(DATA), n = nrows(EDGE), *parent = INTEGER(EDGE), *child = parent + n;
+    int ntips = length(VECTOR_ELT(DATA, 0)), deriv = asLogical(DERIV), nthreads = asInteger(THREADS);
+    int ***X, *iscratch, *ks;
+    double *ELS = REAL(EL), **el, **tabs, *scratch, *loglik, **mp;
+    size_t nwork = 0L, niwork = 0L, len;
+    part_tree tr;
+    ll_ctx **ctxs;
+    SEXP RESULT, LOGLIK, SITELIK, contrast;
+
+    if(length(MODELS) != np || length(CTXS) != np || ncols(EL) != np)
+        error("every partition needs a model, edge lengths and a likelihood context");
+    partTree(parent, child, n, ntips, &tr);
+
+    // everything touching R or allocating is done before the threads start
+    ctxs = (ll_ctx **) R_alloc(np, sizeof(ll_ctx *));
+    el = (double **) R_alloc(np, sizeof(double *));
+    X = (int ***) R_alloc(np, sizeof(int **));
+    // bf, g, w, ll.0, weight and site likelihoods of the partitions
+    mp = (double **) R_alloc(6L * np, sizeof(double *));
+    ks = (int *) R_alloc(np, sizeof(int));
+    PROTECT(RESULT = allocVector(VECSXP, deriv ? 4 : 2));
+    PROTECT(LOGLIK = allocVector(REALSXP, np));
+    PROTECT(SITELIK = allocVector(VECSXP, np));
+    loglik = REAL(LOGLIK);
+    kernel4_init();
+    for(q = 0; q < np; q++){
+        SEXP data = VECTOR_ELT(DATA, q), model = VECTOR_ELT(MODELS, q), eig = VECTOR_ELT(model, 0);
+        int nr = asInteger(getAttrib(data, install("nr"))), nc = asInteger(getAttrib(data, install("nc")));
+        int nco;
+        ks[q] = length(VECTOR_ELT(model, 3));
+        if(length(data) != ntips) error("all partitions need the same taxa");
+        ctxs[q] = getLLCtxNode(VECTOR_ELT(CTXS, q), nr, ntips, nc, ks[q]);
+        contrast = getAttrib(data, install("contrast"));
+        nco = nrows(contrast);
+        ll_ctx_eig(ctxs[q], REAL(VECTOR_ELT(eig, 0)), REAL(VECTOR_ELT(eig, 1)), REAL(VECTOR_ELT(eig, 2)));
+        ll_ctx_contrast(ctxs[q], REAL(contrast), nco);
+        // edge lengths by child node like in outsideLL
+        el[q] = (double *) R_alloc(2L * ntips, sizeof(double));
+        for(i = 0; i < n; i++) el[q][child[i] - 1L] = ELS[i + (size_t) q * n];
+        X[q] = tipData(data, ntips);
+        SET_VECTOR_ELT(SITELIK, q, allocVector(REALSXP, nr));
+        for(j = 0; j < 5; j++) mp[6L * q + j] = REAL(VECTOR_ELT(model, j + 1L));
+        mp[6L * q + 5L] = REAL(VECTOR_ELT(SITELIK, q));
+        partWork(nr, nc, nco, ks[q], &tr, deriv, &nwork, &niwork);
+    }
+    if(nthreads < 1L) nthreads = 1L;
+    if(np < nthreads) nthreads = np;
+    // per thread: work space, score and outer products
+    len = nwork + (deriv ? (size_t) n + (size_t) n * n : 0L);
+    scratch = (double *) R_alloc(len * nthreads, sizeof(double));
+    iscratch = (int *) R_alloc(niwork * nthreads, sizeof(int));
+    tabs = (double **) R_alloc((size_t) n * nthreads, sizeof(double *));
+    for(j = 0; j < (int) (len * nthreads); j++) scratch[j] = 0.0;
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1) if(nthreads > 1)
+#endif
+    for(q = 0; q < np; q++){
+        int tid = 0;
+        double **m = mp + 6L * q, *sc = NULL;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        if(deriv) sc = scratch + len * tid + nwork;
+        loglik[q] = partLL(ctxs[q], X[q], &tr, el[q], m[0], m[1], m[2], ks[q], m[3], m[4], m[5],
+                           tabs + (size_t) n * tid, scratch + len * tid, iscratch + niwork * tid,
+                           sc, sc == NULL ? NULL : sc + n);
+    }
+    for(q = 0; q < np; q++) ll_ctx_dirty(ctxs[q], -1L);
+    SET_VECTOR_ELT(RESULT, 0, LOGLIK);
+    SET_VECTOR_ELT(RESULT, 1, SITELIK);
+    if(deriv) partDeriv(RESULT, scratch, len, nwork, n, nthreads);
+    UNPROTECT(3);
+    return RESULT;
 }
 
 
-SEXP getM3(SEXP dad, SEXP child, SEXP P, SEXP nr, SEXP nc){
-    R_len_t i, n=length(P);
-    int ncx=INTEGER(nc)[0], nrx=INTEGER(nr)[0], j;
-    SEXP TMP, RESULT;
-    double *tmp, *daddy;
-    PROTECT(RESULT = allocVector(VECSXP, n));
-    for(i=0; i<n; i++){
-        PROTECT(TMP = allocMatrix(REALSXP, nrx, ncx));
-        tmp = REAL(TMP);
-//        matprod(REAL(VECTOR_ELT(child, i)), nrx, ncx, REAL(VECTOR_ELT(P, i)), ncx, ncx, tmp);
-        F77_CALL(dgemm)("N", "N", &nrx, &ncx, &ncx, &one, REAL(VECTOR_ELT(child, i)), &nrx, REAL(VECTOR_ELT(P, i)), &ncx, &zero, tmp, &nrx FCONE FCONE);
-        daddy = REAL(VECTOR_ELT(dad, i));
-        for(j=0; j<(ncx * nrx); j++) tmp[j]*=daddy[j];
-        SET_VECTOR_ELT(RESULT, i, TMP);
-        UNPROTECT(1); // TMP
-        }
-    UNPROTECT(1); //RESULT
-    return(RESULT);
+/*
+ * Likelihood with bounded memory for alignments with very many site
+ * patterns: the patterns are evaluated in chunks of CHUNK sites, each
+ * thread has one likelihood context for a chunk, so memory grows with
+ * CHUNK * threads and not with the number of patterns. EDGE, EL and MODEL
+ * (list(eig, bf, g, w, ll.0, weight)) are as for one partition of PMLPart.
+ * Returns list(loglik, siteLik) and with DERIV the score and the outer
+ * product of the site derivatives with respect to the log edge lengths,
+ * accumulated over the chunks.
+ */
+SEXP PMLStream(SEXP dlist, SEXP EDGE, SEXP EL, SEXP MODEL, SEXP CHUNK, SEXP DERIV, SEXP THREADS){
+    int i, j, n = nrows(EDGE), *parent = INTEGER(EDGE), *child = parent + n;
+    int ntips = length(dlist), deriv = asLogical(DERIV), nthreads = asInteger(THREADS);
+    int nr = asInteger(getAttrib(dlist, install("nr"))), nc = asInteger(getAttrib(dlist, install("nc")));
+    int chunk = asInteger(CHUNK), k = length(VECTOR_ELT(MODEL, 3)), nchunk, nco, **X, **Xs, *iscratch;
+    double *el, **tabs, *scratch, *ll, *eig[3], *bf, *g, *w, *ll0, *weight, *sitelik;
+    double *ELS = REAL(EL), *contrast;
+    size_t nwork = 0L, niwork = 0L, len;
+    part_tree tr;
+    ll_ctx **ctxs;
+    SEXP RESULT, LOGLIK, SITELIK, CONTRAST;
+
+    if(chunk < 1L || chunk > nr) chunk = nr;
+    nchunk = (nr + chunk - 1L) / chunk;
+    if(nthreads < 1L) nthreads = 1L;
+    if(nchunk < nthreads) nthreads = nchunk;
+    partTree(parent, child, n, ntips, &tr);
+    el = (double *) R_alloc(2L * ntips, sizeof(double));
+    for(i = 0; i < n; i++) el[child[i] - 1L] = ELS[i];
+    X = tipData(dlist, ntips);
+    for(j = 0; j < 3; j++) eig[j] = REAL(VECTOR_ELT(VECTOR_ELT(MODEL, 0), j));
+    bf = REAL(VECTOR_ELT(MODEL, 1));
+    g = REAL(VECTOR_ELT(MODEL, 2));
+    w = REAL(VECTOR_ELT(MODEL, 3));
+    ll0 = REAL(VECTOR_ELT(MODEL, 4));
+    weight = REAL(VECTOR_ELT(MODEL, 5));
+    CONTRAST = getAttrib(dlist, install("contrast"));
+    contrast = REAL(CONTRAST);
+    nco = nrows(CONTRAST);
+
+    PROTECT(RESULT = allocVector(VECSXP, deriv ? 4 : 2));
+    PROTECT(LOGLIK = allocVector(REALSXP, 1));
+    PROTECT(SITELIK = allocVector(REALSXP, nr));
+    sitelik = REAL(SITELIK);
+    partWork(chunk, nc, nco, k, &tr, deriv, &nwork, &niwork);
+    // per thread: work space, log likelihood, score and outer products
+    len = nwork + 1L + (deriv ? (size_t) n + (size_t) n * n : 0L);
+    scratch = (double *) R_alloc(len * nthreads, sizeof(double));
+    iscratch = (int *) R_alloc(niwork * nthreads, sizeof(int));
+    tabs = (double **) R_alloc((size_t) n * nthreads, sizeof(double *));
+    Xs = (int **) R_alloc((size_t) ntips * nthreads, sizeof(int *));
+    for(j = 0; j < (int) (len * nthreads); j++) scratch[j] = 0.0;
+    kernel4_init();
+    ctxs = (ll_ctx **) R_alloc(nthreads, sizeof(ll_ctx *));
+    for(i = 0; i < nthreads; i++){
+        ctxs[i] = ll_ctx_alloc(chunk, ntips, nc, k, LL_NODE_MAJOR);
+        ll_ctx_eig(ctxs[i], eig[0], eig[1], eig[2]);
+        ll_ctx_contrast(ctxs[i], contrast, nco);
     }
 
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1) if(nthreads > 1)
+#endif
+    for(i = 0; i < nchunk; i++){
+        int h, tid = 0, start = i * chunk, **Xc;
+        double *work, *sc = NULL;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        work = scratch + len * tid;
+        Xc = Xs + (size_t) ntips * tid;
+        for(h = 0; h < ntips; h++) Xc[h] = X[h] + start;
+        // the context holds the partials of the chunk only
+        ctxs[tid]->nr = (start + chunk > nr) ? nr - start : chunk;
+        if(deriv) sc = work + nwork + 1L;
+        work[nwork] += partLL(ctxs[tid], Xc, &tr, el, bf, g, w, k, ll0 + start, weight + start,
+                              sitelik + start, tabs + (size_t) n * tid, work,
+                              iscratch + niwork * tid, sc, sc == NULL ? NULL : sc + n);
+    }
+    ll = REAL(LOGLIK);
+    ll[0] = 0.0;
+    for(i = 0; i < nthreads; i++){
+        ll[0] += scratch[len * i + nwork];
+        ll_ctx_release(ctxs[i]);
+    }
+    SET_VECTOR_ELT(RESULT, 0, LOGLIK);
+    SET_VECTOR_ELT(RESULT, 1, SITELIK);
+    if(deriv) partDeriv(RESULT, scratch, len, nwork + 1L, n, nthreads);
+    UNPROTECT(3);
+    return RESULT;
+}
 
 
-void fs3(double *eva, int nc, double el, double *w, double *g, double *X, int ld, int nr, double *weight,
-         double *f0, double tau, double *res) //, int mkv)
-{
-    int mkv=0;
-    double *tmp, *f, edle, ledle, newedle, eps=10;
-    double ll=0.0, lll, delta=0.0, scalep = 1.0, l1=0.0, l0=0.0;
-    double y, p0=0.0; //sum_wgt=0.0,
-    int i, j, k=0;
-    tmp = (double *) R_alloc(nr, sizeof(double));
-    f = (double *) R_alloc(nr, sizeof(double));
-    edle = el; //REAL(el)[0];
-
-    for(i=0; i<nr; i++)f[i] = f0[i];
-    NR_f(eva, nc, edle, w, g, X, ld, nr, f); // nc-1L !!!
-    if(mkv){
-      for(j=0; j<nr; j++)p0 += f[i];
-      for(i=0; i<nr ;i++) f[i] /= (1-p0);
-    }
-    for(i=0; i<nr ;i++){
-      l0 += weight[i] * log(f[i]);
-      //sum_wgt += weight[i];
-    }
-
-    while ( (eps > 1e-05) &&  (k < 10) ) {
-        if(scalep>0.6){
-            NR_df(eva, nc-1L, edle, w, g, X, ld, nr, f, tmp);
-            ll=0.0;
-            lll=0.0;
-            for(i=0; i<nr ;i++){
-                y = weight[i]*tmp[i];
-                ll+=y;
-                lll+=y*tmp[i];
-            }
-            delta = ((ll/lll) < 3) ? (ll/lll) : 3;
-        } // end if
-        ledle = log(edle) + scalep * delta;
-        newedle = exp(ledle);
-        // some error handling avoid too big small edges & too big steps
-        if (newedle > 10.0) newedle = 10.0;
-        if (newedle < tau) newedle = tau; // 1e-8 phyML
-
-        for(i=0; i<nr; i++)f[i] = f0[i];
-        NR_f(eva, nc, newedle, w, g, X, ld, nr, f);
-        if(mkv){
-          for(j=0; j<nc; j++)p0 += f[i];
-          for(i=0; i<nr ;i++) f[i] /= (1-p0);
-        }
-        l1 = 0.0;
-        for(i=0; i<nr ;i++) l1 += weight[i] * log(f[i]);
-        eps = l1 - l0;
-        // some error handling
-        if (eps < 0 || ISNAN(eps)) {
-            if (ISNAN(eps))eps = 0;
-            else {
-                scalep = scalep/2.0;
-                eps = 1.0;
-            }
-            newedle = edle;
-            l1 = l0;
-        }
-        else scalep = 1.0;
-        edle=newedle;
-        l0 = l1;
-        k ++;
-    }
-    // variance n
-    NR_d2f(eva, nc-1L, edle, w, g, X, ld, nr, f, tmp);
-    lll=0.0;
-    for(i=0; i<nr ;i++) lll+=weight[i]*tmp[i]*tmp[i];
-    res[0] = edle;
-    res[1] = 1.0 / lll;
-    res[2] = l0; //l0
-    // return res[3] = 1 or 0 for success
+/*
+ * Likelihoods of many trees (a multiPhylo with common tip labels) for one
+ * alignment and model. Tip data, eigen system and contrast are set up once,
+ * the trees are scored in parallel, each thread with its own likelihood
+ * context. Transition matrices stay cached in a context as long as the
+ * edge lengths match. EDGES and ELS are lists with the edge matrices in
+ * postorder and the edge lengths of the trees, MODEL as for PMLStream.
+ * Returns list(loglik, siteLik), siteLik being the nr x ntrees matrix of
+ * site log likelihoods if SITE and NULL otherwise.
+ */
+SEXP PMLMulti(SEXP dlist, SEXP EDGES, SEXP ELS, SEXP MODEL, SEXP SITE, SEXP THREADS){
+    int i, j, nt = length(EDGES), ntips = length(dlist), site = asLogical(SITE);
+    int nthreads = asInteger(THREADS), nr = asInteger(getAttrib(dlist, install("nr")));
+    int nc = asInteger(getAttrib(dlist, install("nc"))), k = length(VECTOR_ELT(MODEL, 3));
+    int nco, **X, *iscratch;
+    double **el, **tabs, *scratch, *loglik, *sitelik = NULL, *eig[3], *bf, *g, *w, *ll0, *weight;
+    double *contrast;
+    size_t nwork = 0L, niwork = 0L, len;
+    part_tree *trs;
+    ll_ctx **ctxs;
+    SEXP RESULT, LOGLIK, SITELIK = R_NilValue, CONTRAST;
+
+    if(length(ELS) != nt) error("every tree needs edge lengths");
+    X = tipData(dlist, ntips);
+    for(j = 0; j < 3; j++) eig[j] = REAL(VECTOR_ELT(VECTOR_ELT(MODEL, 0), j));
+    bf = REAL(VECTOR_ELT(MODEL, 1));
+    g = REAL(VECTOR_ELT(MODEL, 2));
+    w = REAL(VECTOR_ELT(MODEL, 3));
+    ll0 = REAL(VECTOR_ELT(MODEL, 4));
+    weight = REAL(VECTOR_ELT(MODEL, 5));
+    CONTRAST = getAttrib(dlist, install("contrast"));
+    contrast = REAL(CONTRAST);
+    nco = nrows(CONTRAST);
+
+    // trees and edge lengths by child node, set up before the threads start
+    trs = (part_tree *) R_alloc(nt, sizeof(part_tree));
+    el = (double **) R_alloc(nt, sizeof(double *));
+    for(i = 0; i < nt; i++){
+        SEXP edge = VECTOR_ELT(EDGES, i);
+        int n = nrows(edge), *parent = INTEGER(edge);
+        if(length(VECTOR_ELT(ELS, i)) != n) error("tree %d: edge lengths do not match the edges", i + 1);
+        partTree(parent, parent + n, n, ntips, &trs[i]);
+        el[i] = (double *) R_alloc(2L * ntips, sizeof(double));
+        for(j = 0; j < n; j++) el[i][parent[n + j] - 1L] = REAL(VECTOR_ELT(ELS, i))[j];
+        partWork(nr, nc, nco, k, &trs[i], 0L, &nwork, &niwork);
+    }
+    if(nthreads < 1L) nthreads = 1L;
+    if(nt < nthreads) nthreads = nt;
+    PROTECT(RESULT = allocVector(VECSXP, 2));
+    PROTECT(LOGLIK = allocVector(REALSXP, nt));
+    loglik = REAL(LOGLIK);
+    if(site){
+        SITELIK = allocMatrix(REALSXP, nr, nt);
+        SET_VECTOR_ELT(RESULT, 1, SITELIK);
+        sitelik = REAL(SITELIK);
+    }
+    // per thread: work space and site log likelihoods
+    len = nwork + (size_t) nr;
+    scratch = (double *) R_alloc(len * nthreads, sizeof(double));
+    iscratch = (int *) R_alloc(niwork * nthreads, sizeof(int));
+    tabs = (double **) R_alloc((size_t) (2L * ntips) * nthreads, sizeof(double *));
+    kernel4_init();
+    ctxs = (ll_ctx **) R_alloc(nthreads, sizeof(ll_ctx *));
+    for(i = 0; i < nthreads; i++){
+        ctxs[i] = ll_ctx_alloc(nr, ntips, nc, k, LL_NODE_MAJOR);
+        ll_ctx_eig(ctxs[i], eig[0], eig[1], eig[2]);
+        ll_ctx_contrast(ctxs[i], contrast, nco);
+    }
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1) if(nthreads > 1)
+#endif
+    for(i = 0; i < nt; i++){
+        int tid = 0;
+        double *work, *sl;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        work = scratch + len * tid;
+        sl = site ? sitelik + (size_t) nr * i : work + nwork;
+        loglik[i] = partLL(ctxs[tid], X, &trs[i], el[i], bf, g, w, k, ll0, weight, sl,
+                           tabs + (size_t) (2L * ntips) * tid, work, iscratch + niwork * tid,
+                           NULL, NULL);
+    }
+    for(i = 0; i < nthreads; i++) ll_ctx_release(ctxs[i]);
+    SET_VECTOR_ELT(RESULT, 0, LOGLIK);
+    UNPROTECT(2);
+    return RESULT;
 }
 
+/*
+ * RELL bootstrap (resampling estimated log-likelihoods): B multinomial
+ * resamplings of the site patterns are drawn once, every tree visited during
+ * a search is scored for all replicates from its site log-likelihoods, and
+ * the best log-likelihood of each replicate is kept.
+ */
+typedef struct rell_ctx {
+    int B, nr, nthreads;
+    int *X;         // nr x B resampled weights, a column per replicate
+    double *ll;     // best log-likelihood of each replicate
+} rell_ctx;
 
-// in fs()
-SEXP FS4(SEXP eig, SEXP nc, SEXP el, SEXP w, SEXP g, SEXP X, SEXP dad, SEXP child, SEXP ld, SEXP nr,
-         SEXP weight, SEXP f0, SEXP tau, SEXP retA, SEXP retB)
-{
-    SEXP RESULT, EL, P;
-    double *tmp, *wgt=REAL(weight), edle, *eva=REAL(VECTOR_ELT(eig,0));
-    int ncx=INTEGER(nc)[0], nrx=INTEGER(nr)[0];
-    tmp = (double *) R_alloc(3L, sizeof(double));
-    PROTECT(RESULT = allocVector(VECSXP, 4));
-    edle = REAL(el)[0];
-    fs3(eva, ncx, edle, REAL(w), REAL(g), REAL(X), INTEGER(ld)[0], nrx, wgt, REAL(f0), REAL(tau)[0], tmp);
-    PROTECT(EL = ScalarReal(tmp[0]));
-    PROTECT(P = getPM(eig, nc, EL, g));
-    SET_VECTOR_ELT(RESULT, 0, EL);
-    if(INTEGER(retA)[0]>0L)SET_VECTOR_ELT(RESULT, 1, getM3(child, dad, P, nr, nc));
-    if(INTEGER(retB)[0]>0L)SET_VECTOR_ELT(RESULT, 2, getM3(dad, child, P, nr, nc));
-// add variance ??
-    SET_VECTOR_ELT(RESULT, 3, ScalarReal(tmp[2]));
-    UNPROTECT(3);
-    return (RESULT);
+
+static void rell_release(rell_ctx *rell){
+    if(rell == NULL) return;
+    free(rell->X);
+    free(rell->ll);
+    free(rell);
 }
 
-// in dist.ml
-SEXP FS5(SEXP eig, SEXP nc, SEXP el, SEXP w, SEXP g, SEXP X, SEXP ld, SEXP nr, SEXP weight, SEXP f0, SEXP tau)
-{
-    SEXP RESULT; // EL, P;
-    double *wgt=REAL(weight), *eva=REAL(VECTOR_ELT(eig,0));
-    int ncx=INTEGER(nc)[0], nrx=INTEGER(nr)[0];
-    PROTECT(RESULT = allocVector(REALSXP, 3));
-    double edle = REAL(el)[0];
-    fs3(eva, ncx, edle, REAL(w), REAL(g), REAL(X), INTEGER(ld)[0], nrx, wgt, REAL(f0), REAL(tau)[0], REAL(RESULT));
+
+static void rell_finalize(SEXP RELL){
+    rell_release((rell_ctx *) R_ExternalPtrAddr(RELL));
+    R_ClearExternalPtr(RELL);
+}
+
+
+static rell_ctx *getRellCtx(SEXP RELL){
+    rell_ctx *rell = NULL;
+    if(TYPEOF(RELL) == EXTPTRSXP) rell = (rell_ctx *) R_ExternalPtrAddr(RELL);
+    if(rell == NULL) error("RELL context not initialized or freed");
+    return rell;
+}
+
+
+// WEIGHT integer weights of the site patterns, B number of replicates
+SEXP rell_new(SEXP WEIGHT, SEXP B, SEXP THREADS){
+    int i, b, nr = length(WEIGHT), nb = asInteger(B), n = 0, *weight = INTEGER(WEIGHT);
+    double *prob;
+    rell_ctx *rell;
+    SEXP RELL;
+    if(nb < 1L) error("B must be positive");
+    for(i = 0; i < nr; i++) n += weight[i];
+    prob = (double *) R_alloc(nr, sizeof(double));
+    for(i = 0; i < nr; i++) prob[i] = (double) weight[i] / n;
+    rell = (rell_ctx *) calloc(1, sizeof(rell_ctx));
+    if(rell == NULL) error("out of memory");
+    rell->B = nb;
+    rell->nr = nr;
+    rell->nthreads = 1L;
+#ifdef _OPENMP
+    if(asInteger(THREADS) > 1L) rell->nthreads = asInteger(THREADS);
+#else
+    (void) THREADS;
+#endif
+    rell->X = (int *) malloc((size_t) nr * nb * sizeof(int));
+    rell->ll = (double *) malloc(nb * sizeof(double));
+    if(rell->X == NULL || rell->ll == NULL){
+        rell_release(rell);
+        error("out of memory");
+    }
+    GetRNGstate();
+    for(b = 0; b < nb; b++){
+        rmultinom(n, prob, nr, rell->X + (size_t) nr * b);
+        rell->ll[b] = R_NegInf;
+    }
+    PutRNGstate();
+    PROTECT(RELL = R_MakeExternalPtr(rell, R_NilValue, R_NilValue));
+    R_RegisterCFinalizerEx(RELL, rell_finalize, TRUE);
     UNPROTECT(1);
-    return (RESULT);
+    return RELL;
 }
 
 
-SEXP optE(SEXP PARENT, SEXP CHILD, SEXP ANC, SEXP eig, SEXP EVI, SEXP EL,
-                  SEXP W, SEXP G, SEXP NR, SEXP NC, SEXP NTIPS, SEXP CONTRAST,
-                  SEXP CONTRAST2, SEXP NCO,
-                  SEXP dlist, SEXP WEIGHT, SEXP F0, SEXP TAU){
-    int i, k=length(W), h, j, n=length(PARENT), m, lEL=length(EL);
-    int nc=INTEGER(NC)[0], nr=INTEGER(NR)[0], ntips=INTEGER(NTIPS)[0];
-    int *parent=INTEGER(PARENT), *child=INTEGER(CHILD), *anc=INTEGER(ANC);
-    int loli, nco =INTEGER(NCO)[0];
-    double *weight=REAL(WEIGHT), *f0=REAL(F0), *w=REAL(W), tau=REAL(TAU)[0];
-    double *g=REAL(G), *evi=REAL(EVI), *contrast=REAL(CONTRAST), *contrast2=REAL(CONTRAST2);
-    double *el; //=REAL(EL);
-    double *eva, *eve, *evei, *tmp, *P;
-    double  *X; // define it *blub=REAL(BLUB),
-    double *blub = (double *) R_alloc(nr * k, sizeof(double));
-    double oldel; //=el[ch-1L]
-    int ancloli, pa, ch; //=anc[loli]
-    double *res = (double *) R_alloc(3L, sizeof(double));
-    tmp = (double *) R_alloc(nr * nc, sizeof(double));
-    P = (double *) R_alloc(nc * nc, sizeof(double));
-    X = (double *) R_alloc(k * nr * nc, sizeof(double));
+SEXP rell_free(SEXP RELL){
+    if(TYPEOF(RELL) == EXTPTRSXP) rell_finalize(RELL);
+    return R_NilValue;
+}
 
-    ExtractScale(parent[0], k, &nr, &ntips, blub);
 
+// scores a tree with site log-likelihoods SITELIK for all replicates,
+// returns the (1-based) replicates for which it is the best tree so far
+SEXP rell_update(SEXP RELL, SEXP SITELIK){
+    rell_ctx *rell = getRellCtx(RELL);
+    int b, i, nb = rell->B, nr = rell->nr, nbetter = 0, *res;
+    double *sitelik = REAL(SITELIK);
+    char *better;
     SEXP RESULT;
-    PROTECT(RESULT = allocVector(REALSXP, lEL));
-    el=REAL(RESULT);
-    for(i = 0; i < lEL; i++) el[i] = REAL(EL)[i];
-    eva = REAL(VECTOR_ELT(eig, 0));
-    eve = REAL(VECTOR_ELT(eig, 1));
-    evei = REAL(VECTOR_ELT(eig, 2));
+    if(length(SITELIK) != nr) error("site log-likelihoods do not match the data");
+    better = (char *) R_alloc(nb, sizeof(char));
+#ifdef _OPENMP
+    int nthreads = rell->nthreads;
+#pragma omp parallel for num_threads(nthreads) schedule(static) if(nthreads > 1) reduction(+:nbetter)
+#endif
+    for(b = 0; b < nb; b++){
+        int *x = rell->X + (size_t) nr * b;
+        double ll = 0.0;
+        for(int s = 0; s < nr; s++) if(x[s]) ll += x[s] * sitelik[s];
+        better[b] = ll > rell->ll[b];
+        if(better[b]){
+            rell->ll[b] = ll;
+            nbetter++;
+        }
+    }
+    PROTECT(RESULT = allocVector(INTSXP, nbetter));
+    res = INTEGER(RESULT);
+    for(b = 0, i = 0; b < nb; b++) if(better[b]) res[i++] = b + 1L;
+    UNPROTECT(1);
+    return RESULT;
+}
 
-    loli = parent[0];
-    for(m = 0; m < n; m++){
-        pa = parent[m];
-        ch = child[m];
-        oldel=el[ch-1L];
 
-    while(loli != pa){
-        ancloli=anc[loli];
-        for(i = 0; i < k; i++){
-            getP(eva, eve, evei, nc, el[loli-1L], g[i], P);
-            moveLL5(&LL[LINDEX(loli, i)], &LL[LINDEX(ancloli, i)], P, &nr, &nc, tmp);
-        }
-        loli = ancloli;
+// splitmix64, the generator of each replicate of SHtest is seeded from the
+// replicate number so the result does not depend on the number of threads
+static inline uint64_t splitmix64(uint64_t *x){
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+
+// Shimodaira-Hasegawa test, SITELIK nr x T matrix of site log-likelihoods,
+// WEIGHT integer weights of the site patterns. Each of the B replicates
+// resamples the sites, the log-likelihoods of the trees are centred by their
+// expectation under resampling (the observed log-likelihoods) and compared
+// with the difference to the best tree. Only T values are kept per replicate.
+// Returns for each tree the number of replicates exceeding its difference.
+SEXP SHtest(SEXP SITELIK, SEXP WEIGHT, SEXP B, SEXP THREADS){
+    int i, j, nr = nrows(SITELIK), nt = ncols(SITELIK), nb = asInteger(B), nthreads = 1L;
+    int n = 0, *weight = INTEGER(WEIGHT), *site, *count, *boots, *res;
+    double *sitelik = REAL(SITELIK), *lalpha, *talpha, *Ms, lmax = R_NegInf;
+    uint64_t seed;
+    SEXP RESULT;
+    if(length(WEIGHT) != nr) error("weight does not match the site log-likelihoods");
+#ifdef _OPENMP
+    if(asInteger(THREADS) > 1L) nthreads = asInteger(THREADS);
+#else
+    (void) THREADS;
+#endif
+    for(i = 0; i < nr; i++) n += weight[i];
+    // site s occurs weight[s] times in the alignment
+    site = (int *) R_alloc(n, sizeof(int));
+    for(i = 0, j = 0; i < nr; i++) for(int h = 0; h < weight[i]; h++) site[j++] = i;
+    lalpha = (double *) R_alloc(nt, sizeof(double));
+    talpha = (double *) R_alloc(nt, sizeof(double));
+    for(j = 0; j < nt; j++){
+        double *L = sitelik + (size_t) nr * j, l = 0.0;
+        for(i = 0; i < nr; i++) l += weight[i] * L[i];
+        lalpha[j] = l;
+        if(l > lmax) lmax = l;
     }
-    // moveDad
-    if(ch>ntips){
-        for(i = 0; i < k; i++){
-            getP(eva, eve, evei, nc, oldel, g[i], P);
-            helpDADI(&LL[LINDEX(pa, i)], &LL[LINDEX(ch, i)], P, nr, nc, tmp);
-            helpPrep(&LL[LINDEX(pa, i)], &LL[LINDEX(ch, i)], eve, evi, nr, nc, tmp, &X[i*nr*nc]);
-            for(h = 0; h < nc; h++){
-                for(j = 0; j < nr; j++){
-                    X[j+h*nr + i*nr*nc] *= blub[j+i*nr];
-                }
+    for(j = 0; j < nt; j++) talpha[j] = lmax - lalpha[j];
+    count = (int *) R_alloc((size_t) nt * nthreads, sizeof(int));
+    memset(count, 0, (size_t) nt * nthreads * sizeof(int));
+    boots = (int *) R_alloc((size_t) nr * nthreads, sizeof(int));
+    Ms = (double *) R_alloc((size_t) nt * nthreads, sizeof(double));
+    GetRNGstate();
+    seed = (uint64_t) (unif_rand() * 4294967296.0) << 32 | (uint64_t) (unif_rand() * 4294967296.0);
+    PutRNGstate();
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nthreads) if(nthreads > 1)
+#endif
+    {
+        int b, tid = 0, *boot, *cnt;
+        double *M;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        boot = boots + (size_t) nr * tid;
+        cnt = count + (size_t) nt * tid;
+        M = Ms + (size_t) nt * tid;
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+        for(b = 0; b < nb; b++){
+            uint64_t state = seed ^ ((uint64_t) b * 0xD1B54A32D192ED03ULL);
+            double mmin = R_PosInf;
+            memset(boot, 0, nr * sizeof(int));
+            for(int h = 0; h < n; h++)
+                boot[site[(int) ((splitmix64(&state) >> 11) * (1.0 / 9007199254740992.0) * n)]]++;
+            for(int t = 0; t < nt; t++){
+                double *L = sitelik + (size_t) nr * t, m = 0.0;
+                for(int s = 0; s < nr; s++) if(boot[s]) m += boot[s] * L[s];
+                M[t] = m - lalpha[t];
+                if(M[t] < mmin) mmin = M[t];
             }
+            for(int t = 0; t < nt; t++) if(M[t] - mmin > talpha[t]) cnt[t]++;
         }
     }
-    else{
-        for(i = 0; i < k; i++){
-            getP(eva, eve, evei, nc, oldel, g[i], P);
-            helpDAD5(&LL[LINDEX(pa, i)], INTEGER(VECTOR_ELT(dlist, ch-1L)), contrast, P, nr, nc, nco, tmp);
-            helpPrep2(&LL[LINDEX(pa, i)], INTEGER(VECTOR_ELT(dlist, ch-1L)), contrast2, evi, nr, nc, nco, &X[i*nr*nc]); //;
-            for(h = 0; h < nc; h++){
-                for(j = 0; j < nr; j++){
-                    X[j+h*nr + i*nr*nc] *= blub[j+i*nr];
-                }
+    PROTECT(RESULT = allocVector(INTSXP, nt));
+    res = INTEGER(RESULT);
+    for(j = 0; j < nt; j++){
+        res[j] = 0;
+        for(i = 0; i < nthreads; i++) res[j] += count[j + (size_t) nt * i];
+    }
+    UNPROTECT(1);
+    return RESULT;
+}
+
+
+/*
+ * CLV checkpointing: a store that keeps the partials of at most nslot
+ * vectors. Keys below nnode are the partials of the internal nodes (the
+ * subtree below, as in PML4), key nnode + v - 1 is the partial at the parent
+ * p of v without the subtree of v (UP in outsideLL). If the store is full
+ * a vector that is not in use (pin) is evicted, the least recently used
+ * one (CLV_LRU) or the one farthest in the tree from the current edge
+ * (CLV_DIST). Evicted vectors get recomputed on demand from the partials
+ * of their neighbours.
+ */
+#define CLV_LRU 0
+#define CLV_DIST 1
+
+typedef struct clv_store {
+    int nslot, nkey, policy, nr, nc, k, ntips, nnode, root, cur, **X;
+    int *anc, *depth, *start, *kids, *key2slot, *slot2key, *pin, *S;
+    double *V, *el, *g, *tmp;
+    long clock, *stamp, computed;
+    ll_ctx *ctx;
+} clv_store;
+
+
+static int clvDist(clv_store *st, int a, int b){
+    int d = 0;
+    while(st->depth[a] > st->depth[b]){ a = st->anc[a]; d++; }
+    while(st->depth[b] > st->depth[a]){ b = st->anc[b]; d++; }
+    while(a != b){ a = st->anc[a]; b = st->anc[b]; d += 2; }
+    return d;
+}
+
+
+// node a key belongs to
+static int clvNode(clv_store *st, int key){
+    return (key < st->nnode) ? key + st->ntips + 1L : key - st->nnode + 1L;
+}
+
+
+// pinned slot for key, the vector is not computed yet
+static int clvSlot(clv_store *st, int key){
+    int i, sl = -1, d, best = -1;
+    for(i = 0; i < st->nslot && sl < 0; i++) if(st->slot2key[i] < 0) sl = i;
+    if(sl < 0){
+        for(i = 0; i < st->nslot; i++){
+            if(st->pin[i]) continue;
+            if(st->policy == CLV_DIST){
+                d = clvDist(st, clvNode(st, st->slot2key[i]), st->cur);
+                if(d > best){ best = d; sl = i; }
             }
+            else if(sl < 0 || st->stamp[i] < st->stamp[sl]) sl = i;
         }
+        // can not happen as long as nslot exceeds the height of the tree
+        if(sl < 0) error("CLV budget too small");
+        st->key2slot[st->slot2key[sl]] = -1L;
     }
-    fs3(eva, nc, oldel, w, g, X, k, nr, weight, f0, tau, res);
-    updateLL2(dlist, pa, ch, eva, eve, evei, res[0], g, nr,
-        nc, ntips, contrast, nco, k, tmp, P);
-        el[ch-1L] = res[0];
-        if (ch > ntips) loli  = ch;
-        else loli = pa;
+    st->slot2key[sl] = key;
+    st->key2slot[key] = sl;
+    st->stamp[sl] = st->clock++;
+    st->pin[sl] = 1L;
+    st->computed++;
+    return sl;
+}
+
+
+// pinned slot of key if it is in the store, otherwise -1
+static int clvFind(clv_store *st, int key){
+    int sl = st->key2slot[key];
+    if(sl >= 0){
+        st->stamp[sl] = st->clock++;
+        st->pin[sl]++;
     }
-    UNPROTECT(1); //RESULT
-    return(RESULT);
+    return sl;
 }
 
 
-SEXP optQrtt(SEXP PARENT, SEXP CHILD, SEXP eig, SEXP EVI, SEXP EL,
-          SEXP W, SEXP G, SEXP NR, SEXP NC, SEXP NTIPS, SEXP CONTRAST,
-          SEXP CONTRAST2, SEXP NCO,
-          SEXP dlist, SEXP WEIGHT, SEXP F0, SEXP TAU){
-    int i, k=length(W), h, j, m, lEL=length(EL);
-    int nc=INTEGER(NC)[0], nr=INTEGER(NR)[0], ntips=INTEGER(NTIPS)[0];
-    int *parent=INTEGER(PARENT), *child=INTEGER(CHILD), pa, ch;
-    int nco =INTEGER(NCO)[0]; // loli,
-    double *weight=REAL(WEIGHT), *f0=REAL(F0), *w=REAL(W), tau=REAL(TAU)[0];
-    double *g=REAL(G), *evi=REAL(EVI), *contrast=REAL(CONTRAST), *contrast2=REAL(CONTRAST2);
-    double *el, *X;
-    double *eva, *eve, *evei, *tmp, *P;
-    double *blub = (double *) R_alloc(nr * k, sizeof(double));
-    double oldel;
-    double *res = (double *) R_alloc(3L, sizeof(double));
-    tmp = (double *) R_alloc(nr * nc, sizeof(double));
-    P = (double *) R_alloc(nc * nc, sizeof(double));
-    X = (double *) R_alloc(k * nr * nc, sizeof(double));
+static void clvDrop(clv_store *st, int key){
+    int sl = st->key2slot[key];
+    if(sl < 0) return;
+    st->slot2key[sl] = -1L;
+    st->key2slot[key] = -1L;
+    st->pin[sl] = 0L;
+}
 
-    ExtractScale(parent[0], k, &nr, &ntips, blub);
 
-    SEXP RESULT;
-    PROTECT(RESULT = allocVector(REALSXP, lEL));
-    el=REAL(RESULT);
-    for(i = 0; i < lEL; i++) el[i] = REAL(EL)[i];
+#define CLV_V(st, sl) (&(st)->V[(size_t) (sl) * (st)->nr * (st)->nc * (st)->k])
+#define CLV_S(st, sl) (&(st)->S[(size_t) (sl) * (st)->nr * (st)->k])
+
+
+// multiply the message of child c into the vector of slot sl, the partials
+// of c are taken from the store
+static int clvDown(clv_store *st, int v);
+
+static void clvMsg(clv_store *st, int sl, int c, int set){
+    int r, j, cs, nr = st->nr, nc = st->nc;
+    size_t rc = (size_t) nr * nc;
+    double *V = CLV_V(st, sl), *P;
+    int *S = CLV_S(st, sl);
+    if(c <= st->ntips){
+        for(r = 0; r < st->k; r++){
+            P = getTctx(st->ctx, c, r, st->el[c - 1L], st->g[r]);
+            if(set) tipLookup(st->X[c - 1L], P, nr, nr, nc, st->ctx->nco, &V[rc * r]);
+            else tipMult(st->X[c - 1L], P, nr, nr, nc, st->ctx->nco, &V[rc * r]);
+        }
+        if(set) for(j = 0; j < nr * st->k; j++) S[j] = 0L;
+        return;
+    }
+    cs = clvDown(st, c);
+    for(r = 0; r < st->k; r++){
+        P = getPctx(st->ctx, c, r, st->el[c - 1L], st->g[r]);
+        if(set) vecP(&CLV_V(st, cs)[rc * r], P, nr, nc, &V[rc * r]);
+        else{
+            vecP(&CLV_V(st, cs)[rc * r], P, nr, nc, st->tmp);
+            for(j = 0; j < (int) rc; j++) V[rc * r + j] *= st->tmp[j];
+        }
+    }
+    for(j = 0; j < nr * st->k; j++) S[j] = (set ? 0L : S[j]) + CLV_S(st, cs)[j];
+    st->pin[cs]--;
+}
+
+
+static void clvScale(clv_store *st, int sl){
+    int r;
+    for(r = 0; r < st->k; r++)
+        scaleBlock(&CLV_V(st, sl)[(size_t) st->nr * st->nc * r], st->nr, st->nr, st->nc,
+                   &CLV_S(st, sl)[(size_t) st->nr * r]);
+}
+
+
+// pinned slot with the partials of the subtree of internal node v, the
+// internal children are computed first so only v and one child are pinned
+// per level
+static int clvDown(clv_store *st, int v){
+    int s, c, sl = clvFind(st, v - st->ntips - 1L);
+    if(sl >= 0) return sl;
+    for(s = st->start[v]; s < st->start[v + 1L]; s++){
+        c = st->kids[s];
+        if(c <= st->ntips) continue;
+        if(sl < 0){
+            // computing the child first keeps the slot of v free meanwhile
+            int cs = clvDown(st, c);
+            sl = clvSlot(st, v - st->ntips - 1L);
+            clvMsg(st, sl, c, 1L);
+            st->pin[cs]--;
+        }
+        else clvMsg(st, sl, c, 0L);
+    }
+    for(s = st->start[v]; s < st->start[v + 1L]; s++){
+        c = st->kids[s];
+        if(c > st->ntips) continue;
+        if(sl < 0){
+            sl = clvSlot(st, v - st->ntips - 1L);
+            clvMsg(st, sl, c, 1L);
+        }
+        else clvMsg(st, sl, c, 0L);
+    }
+    clvScale(st, sl);
+    return sl;
+}
+
+
+// pinned slot with the partial at the parent p of v without the subtree of
+// v, see outsideNode
+static int clvUp(clv_store *st, int v){
+    int s, r, j, ps, p = st->anc[v], key = st->nnode + v - 1L, sl = clvFind(st, key);
+    size_t rc = (size_t) st->nr * st->nc;
+    if(sl >= 0) return sl;
+    if(p != st->root){
+        ps = clvUp(st, p);
+        sl = clvSlot(st, key);
+        for(r = 0; r < st->k; r++)
+            vecP(&CLV_V(st, ps)[rc * r], getPctx(st->ctx, p, r, st->el[p - 1L], st->g[r]),
+                 st->nr, st->nc, &CLV_V(st, sl)[rc * r]);
+        memcpy(CLV_S(st, sl), CLV_S(st, ps), (size_t) st->nr * st->k * sizeof(int));
+        st->pin[ps]--;
+    }
+    else{
+        sl = clvSlot(st, key);
+        for(j = 0; j < (int) rc * st->k; j++) CLV_V(st, sl)[j] = 1.0;
+        for(j = 0; j < st->nr * st->k; j++) CLV_S(st, sl)[j] = 0L;
+    }
+    for(s = st->start[p]; s < st->start[p + 1L]; s++){
+        if(st->kids[s] != v) clvMsg(st, sl, st->kids[s], 0L);
+    }
+    clvScale(st, sl);
+    return sl;
+}
+
+
+/*
+ * Edge length smoothing like optE, but the partials are kept in a store of
+ * BUDGET vectors (see clv_store) instead of the likelihood context, so
+ * memory does not grow with the number of nodes. The edges are visited in
+ * preorder, for the edge to v the partials at both ends come from the
+ * store, after a change of its length the partials of the ancestors of v
+ * are dropped. PARENT and CHILD are the edges in postorder, EL the edge
+ * lengths by child node. POLICY selects the eviction, 0 least recently
+ * used and 1 tree distance. Returns list(edge lengths, log-likelihood,
+ * c(eps, sweeps), c(start log-likelihood, vectors computed)).
+ */
+SEXP optECkpt(SEXP PARENT, SEXP CHILD, SEXP eig, SEXP EVI, SEXP EL, SEXP W, SEXP G,
+              SEXP NR, SEXP NC, SEXP NTIPS, SEXP CONTRAST, SEXP CONTRAST2, SEXP NCO,
+              SEXP dlist, SEXP WEIGHT, SEXP F0, SEXP TAU, SEXP MAXIT, SEXP EPS,
+              SEXP BUDGET, SEXP POLICY){
+    int i, j, h, m, r, v, p, us, ds, mn, iter, n = length(PARENT), lEL = length(EL);
+    int nr = asInteger(NR), nc = asInteger(NC), ntips = asInteger(NTIPS), nco = asInteger(NCO);
+    int k = length(W), maxit = asInteger(MAXIT), height = 0;
+    int *parent = INTEGER(PARENT), *child = INTEGER(CHILD), *sc, *ppar, *pch, *ord, *stk;
+    double *w = REAL(W), *weight = REAL(WEIGHT), *f0 = REAL(F0), *evi = REAL(EVI);
+    double *contrast2 = REAL(CONTRAST2), tau = asReal(TAU), epsilon = asReal(EPS);
+    double *eva, *eve, *X, *f0s, *work, *el, *elold, res[3], lsc, ll = 0.0, oldll = 0.0, ll0 = 0.0;
+    double eps = 1.0;
+    size_t rc = (size_t) nr * nc;
+    clv_store st;
+    SEXP RESULT, ELR, CONV, INFO;
+
     eva = REAL(VECTOR_ELT(eig, 0));
     eve = REAL(VECTOR_ELT(eig, 1));
-    evei = REAL(VECTOR_ELT(eig, 2));
+    st.nr = nr;
+    st.nc = nc;
+    st.k = k;
+    st.ntips = ntips;
+    st.nnode = n + 1L - ntips;
+    st.root = parent[n - 1L];
+    st.cur = st.root;
+    st.policy = asInteger(POLICY);
+    st.g = REAL(G);
+    st.X = tipData(dlist, ntips);
+    st.anc = (int *) R_alloc(2L * ntips + 1L, sizeof(int));
+    st.depth = (int *) R_alloc(2L * ntips + 1L, sizeof(int));
+    ppar = (int *) R_alloc(n, sizeof(int));
+    pch = (int *) R_alloc(n, sizeof(int));
+    st.anc[st.root] = st.root;
+    st.depth[st.root] = 0L;
+    for(m = 0; m < n; m++){
+        // reversed postorder, parents come before their children
+        ppar[m] = parent[n - 1L - m];
+        pch[m] = child[n - 1L - m];
+        st.anc[pch[m]] = ppar[m];
+        st.depth[pch[m]] = st.depth[ppar[m]] + 1L;
+        if(st.depth[pch[m]] > height) height = st.depth[pch[m]];
+    }
+    st.start = (int *) R_alloc(2L * ntips + 2L, sizeof(int));
+    st.kids = (int *) R_alloc(n, sizeof(int));
+    nodeChildren(ppar, pch, n, 2L * ntips, st.start, st.kids);
+    // the edges in depth first order, subtrees have to be contiguous (they
+    // are not in the reversed postorder)
+    ord = (int *) R_alloc(n, sizeof(int));
+    stk = (int *) R_alloc(n + 1L, sizeof(int));
+    stk[0] = st.root;
+    for(i = 1, j = 0; i > 0;){
+        v = stk[--i];
+        if(v != st.root) ord[j++] = v;
+        for(h = st.start[v]; h < st.start[v + 1L]; h++) stk[i++] = st.kids[h];
+    }
+    // every level of the recursion pins at most two vectors
+    st.nslot = asInteger(BUDGET);
+    if(st.nslot < 2L * height + 4L) st.nslot = 2L * height + 4L;
+    st.nkey = st.nnode + 2L * ntips;
+    if(st.nslot > st.nkey) st.nslot = st.nkey;
+    st.V = (double *) R_alloc(rc * k * st.nslot, sizeof(double));
+    st.S = (int *) R_alloc((size_t) nr * k * st.nslot, sizeof(int));
+    st.key2slot = (int *) R_alloc(st.nkey, sizeof(int));
+    st.slot2key = (int *) R_alloc(st.nslot, sizeof(int));
+    st.pin = (int *) R_alloc(st.nslot, sizeof(int));
+    st.stamp = (long *) R_alloc(st.nslot, sizeof(long));
+    st.tmp = (double *) R_alloc(rc, sizeof(double));
+    for(i = 0; i < st.nkey; i++) st.key2slot[i] = -1L;
+    for(i = 0; i < st.nslot; i++){
+        st.slot2key[i] = -1L;
+        st.pin[i] = 0L;
+    }
+    st.clock = 0L;
+    st.computed = 0L;
 
-    for(m = 4L; m > -1L; m--){
-        pa = parent[m];
-        ch = child[m];
-        oldel=el[m];
-        // moveDad
-        if(ch>ntips){
-            for(i = 0; i < k; i++){
-                getP(eva, eve, evei, nc, oldel, g[i], P);
-                helpDADI(&LL[LINDEX(pa, i)], &LL[LINDEX(ch, i)], P, nr, nc, tmp);
-                helpPrep(&LL[LINDEX(pa, i)], &LL[LINDEX(ch, i)], eve, evi, nr, nc, tmp, &X[i*nr*nc]);
-                for(h = 0; h < nc; h++){
-                    for(j = 0; j < nr; j++){
-                        X[j+h*nr + i*nr*nc] *= blub[j+i*nr];
-                    }
+    X = (double *) R_alloc(rc * k, sizeof(double));
+    f0s = (double *) R_alloc(nr, sizeof(double));
+    sc = (int *) R_alloc((size_t) nr * k, sizeof(int));
+    work = (double *) R_alloc(FS3_WORK(nc, k, nr), sizeof(double));
+    elold = (double *) R_alloc(lEL, sizeof(double));
+    PROTECT(RESULT = allocVector(VECSXP, 4));
+    PROTECT(ELR = allocVector(REALSXP, lEL));
+    el = REAL(ELR);
+    for(i = 0; i < lEL; i++) el[i] = REAL(EL)[i];
+    st.el = el;
+    kernel4_init();
+    // only the caches of the transition matrices and tip tables are used
+    st.ctx = ll_ctx_alloc(1L, ntips, nc, k, LL_NODE_MAJOR);
+    ll_ctx_eig(st.ctx, eva, eve, REAL(VECTOR_ELT(eig, 2)));
+    ll_ctx_contrast(st.ctx, REAL(CONTRAST), nco);
+
+    for(iter = 0; iter < maxit && eps > epsilon; iter++){
+        for(i = 0; i < lEL; i++) elold[i] = el[i];
+        for(m = 0; m < n; m++){
+            v = ord[m];
+            p = st.anc[v];
+            st.cur = v;
+            // partials outside v are stale after the last sweep
+            clvDrop(&st, st.nnode + v - 1L);
+            us = clvUp(&st, v);
+            ds = -1L;
+            if(v > ntips){
+                ds = clvDown(&st, v);
+                for(r = 0; r < k; r++)
+                    helpPrep(&CLV_V(&st, us)[rc * r], &CLV_V(&st, ds)[rc * r], eve, evi, nr, nc,
+                             st.tmp, &X[rc * r]);
+            }
+            else{
+                for(r = 0; r < k; r++)
+                    helpPrep2(&CLV_V(&st, us)[rc * r], st.X[v - 1L], contrast2, evi, nr, nc, nco, &X[rc * r]);
+            }
+            for(j = 0; j < nr * k; j++) sc[j] = CLV_S(&st, us)[j] + (ds < 0 ? 0L : CLV_S(&st, ds)[j]);
+            st.pin[us]--;
+            if(ds >= 0) st.pin[ds]--;
+            // scale the rate categories to the smallest scaling of the site
+            lsc = 0.0;
+            for(j = 0; j < nr; j++){
+                mn = sc[j];
+                for(r = 1; r < k; r++) if(sc[j + r * nr] < mn) mn = sc[j + r * nr];
+                for(r = 0; r < k; r++){
+                    if(sc[j + r * nr] == mn) continue;
+                    for(h = 0; h < nc; h++) X[j + h * nr + rc * r] *= exp(LOG_SCALE_EPS * (sc[j + r * nr] - mn));
                 }
+                f0s[j] = (f0[j] > 0.0) ? exp(log(f0[j]) - LOG_SCALE_EPS * mn) : 0.0;
+                lsc += weight[j] * mn * LOG_SCALE_EPS;
             }
-        }
-        else{
-            for(i = 0; i < k; i++){
-                getP(eva, eve, evei, nc, oldel, g[i], P);
-                helpDAD5(&LL[LINDEX(pa, i)], INTEGER(VECTOR_ELT(dlist, ch-1L)), contrast, P, nr, nc, nco, tmp);
-                helpPrep2(&LL[LINDEX(pa, i)], INTEGER(VECTOR_ELT(dlist, ch-1L)), contrast2, evi, nr, nc, nco, &X[i*nr*nc]); //;
-                for(h = 0; h < nc; h++){
-                    for(j = 0; j < nr; j++){
-                        X[j+h*nr + i*nr*nc] *= blub[j+i*nr];
-                    }
+            if(iter == 0 && m == 0){
+                oldll = edgeLogLik(eva, nc, el[v - 1L], w, st.g, X, k, nr, weight, f0s, 0L) + lsc;
+                ll0 = oldll;
+            }
+            fs3w(eva, nc, el[v - 1L], w, st.g, X, k, nr, weight, f0s, tau, 0L, work, res);
+            if(res[0] != el[v - 1L]){
+                el[v - 1L] = res[0];
+                for(h = p; ; h = st.anc[h]){
+                    clvDrop(&st, h - ntips - 1L);
+                    if(h == st.root) break;
                 }
             }
+            ll = res[2] + lsc;
         }
-        fs3(eva, nc, oldel, w, g, X, k, nr, weight, f0, tau, res);
-// go up
-// if i=2 go down
-        if(m==2)updateLLQ(dlist, ch, pa, eva, eve, evei, res[0], g, nr,
-                  nc, ntips, contrast, nco, k, tmp, P);
-        else updateLLQ(dlist, pa, ch, eva, eve, evei, res[0], g, nr,
-                  nc, ntips, contrast, nco, k, tmp, P);
-        el[m] = res[0];
+        eps = (oldll - ll) / ll;
+        // keep the edges of the last sweep if it got worse
+        if(eps < 0){
+            for(i = 0; i < lEL; i++) el[i] = elold[i];
+            ll = oldll;
+            iter++;
+            break;
+        }
+        oldll = ll;
     }
-    UNPROTECT(1); //RESULT
-    return(RESULT);
+    ll_ctx_release(st.ctx);
+    SET_VECTOR_ELT(RESULT, 0, ELR);
+    SET_VECTOR_ELT(RESULT, 1, ScalarReal(ll));
+    PROTECT(CONV = allocVector(REALSXP, 2));
+    REAL(CONV)[0] = eps;
+    REAL(CONV)[1] = (double) iter;
+    SET_VECTOR_ELT(RESULT, 2, CONV);
+    PROTECT(INFO = allocVector(REALSXP, 2));
+    REAL(INFO)[0] = ll0;
+    REAL(INFO)[1] = (double) st.computed;
+    SET_VECTOR_ELT(RESULT, 3, INFO);
+    UNPROTECT(4);
+    return RESULT;
 }